@@ -1,30 +1,216 @@
+#define _GNU_SOURCE
 #include "mnk.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <threads.h>
+#include <stdatomic.h>
+
+#ifdef __linux__
+#	include <pthread.h>
+#	include <sched.h>
+#	include <unistd.h>
+#endif
+
+#ifdef MNK_ENABLE_SHARED
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
 
 #define  RND_IMPLEMENTATION
 #include "rnd.h"
 
+#define MONTE_ARENA_IMPLEMENTATION
+#define MONTE_ARENA_API static
+#include "monte_arena.h"
+
 #define MONTE_GAME_CONFIG_TYPE mnk_config_t
 #define MONTE_STATE_TYPE mnk_state_t
 #define MONTE_MOVE_TYPE mnk_move_t
 #define MONTE_RNG_STATE_TYPE rnd_pcg_t
+#define MONTE_ALLOCATOR_CTX_TYPE monte_arena_t
+#define MONTE_MOVE_CURSOR_TYPE int16_t
+#define MNK_BATCH_LANES 8
+#define MONTE_BATCH_SIZE MNK_BATCH_LANES
+#define MONTE_ENABLE_ROLLOUT_POLICY
+#define MONTE_ENABLE_EVALUATION
+#define MONTE_ENABLE_MOVE_PRIORITY
+#define MONTE_ENABLE_CANONICALIZATION
+#define MONTE_ENABLE_SCHEDULER
+#define MONTE_ENABLE_SNAPSHOT
+#define MONTE_ENABLE_SEQUENTIAL_HALVING
+#define MONTE_ENABLE_STEP
+#define MONTE_ENABLE_COMPACTION
+#define MONTE_ENABLE_TRACE
+#define MONTE_ENABLE_APPLY_AND_INSPECT
+// Boards are small enough that copying them beats undoing every move
+#ifdef MNK_ENABLE_UNDO
+#	define MONTE_ENABLE_UNDO
+#endif
+// Atomic updates slow down private trees, only build it in when needed
+#ifdef MNK_ENABLE_SHARED
+#	define MONTE_ENABLE_SHARED
+#endif
 #define MONTE_IMPLEMENTATION
 #define MONTE_API static
 #define MONTE_USER_FN static
 #include "monte.h"
 
-#define NUM_MONTE_THREADS 4
+#define MNK_AI_DEFAULT_NUM_THREADS 4
+#define MNK_AI_DEFAULT_NUM_ITERATIONS 120000
+#define MNK_AI_CHUNK_SIZE 1024
+#define MNK_AI_DEFAULT_SHARED_SIZE ((size_t)256 << 20)
+#define MNK_AI_VIRTUAL_LOSS 1.0f
+#define MNK_AI_HALVING_NUM_CANDIDATES 16
+
+// Each board cell holds the stone (player + 1, 0 when empty) in its low bits,
+// whether a player would win by playing there and whether it is within
+// candidate_distance of a stone.
+#define MNK_CELL_STONE_MASK 0x03
+#define MNK_CELL_THREAT(player) (0x04 << (player))
+#define MNK_CELL_NEAR 0x10
+
+// Board dimensions, passed by value down the hot path so that each kernel
+// below gets its own copy of the rules with them as constants
+typedef struct {
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+} mnk_dims_t;
+
+#ifdef __GNUC__
+#	define MNK_KERNEL static inline __attribute__((always_inline))
+#else
+#	define MNK_KERNEL static inline
+#endif
+
+// Sizes with a specialized kernel, as values of mnk_state_t.kernel.
+// Other sizes use the generic one, which reads them from the config.
+enum {
+	MNK_KERNEL_GENERIC,
+	MNK_KERNEL_3X3X3,
+	MNK_KERNEL_9X9X5,
+	MNK_KERNEL_15X15X5,
+	MNK_KERNEL_19X19X5,
+
+	MNK_NUM_KERNELS,
+};
+
+static const mnk_dims_t mnk_kernel_dims[MNK_NUM_KERNELS] = {
+	[MNK_KERNEL_3X3X3] = { 3, 3, 3 },
+	[MNK_KERNEL_9X9X5] = { 9, 9, 5 },
+	[MNK_KERNEL_15X15X5] = { 15, 15, 5 },
+	[MNK_KERNEL_19X19X5] = { 19, 19, 5 },
+};
+
+// Run the statement with `dims` set to the dimensions of `state`, as
+// constants when it has a specialized kernel
+#define MNK_DISPATCH(state, ...) \
+	switch ((state)->kernel) { \
+		case MNK_KERNEL_3X3X3: { const mnk_dims_t dims = { 3, 3, 3 }; __VA_ARGS__; } break; \
+		case MNK_KERNEL_9X9X5: { const mnk_dims_t dims = { 9, 9, 5 }; __VA_ARGS__; } break; \
+		case MNK_KERNEL_15X15X5: { const mnk_dims_t dims = { 15, 15, 5 }; __VA_ARGS__; } break; \
+		case MNK_KERNEL_19X19X5: { const mnk_dims_t dims = { 19, 19, 5 }; __VA_ARGS__; } break; \
+		default: { const mnk_dims_t dims = mnk_dims(&(state)->config); __VA_ARGS__; } break; \
+	}
+
+// Board symmetries, as bits of mnk_state_t.symmetries
+enum {
+	MNK_SYMMETRY_IDENTITY,
+	MNK_SYMMETRY_ROTATE_180,
+	MNK_SYMMETRY_FLIP_X,
+	MNK_SYMMETRY_FLIP_Y,
+	// Square boards only
+	MNK_SYMMETRY_ROTATE_90,
+	MNK_SYMMETRY_ROTATE_270,
+	MNK_SYMMETRY_TRANSPOSE,
+	MNK_SYMMETRY_ANTI_TRANSPOSE,
+
+	MNK_NUM_SYMMETRIES,
+};
+
+typedef struct {
+	monte_t* monte;
+	monte_arena_t* arena;
+
+	atomic_flag busy;
+	atomic_int num_chunks_left;
+	// Iterations done by mnk_ai_step for the current move
+	int num_step_iterations;
+
+	monte_job_t job;
+
+	// Taken by mnk_ai_apply before the tree is compacted. mnk_ai_snapshot
+	// reads it instead of the tree while compacting is set.
+	monte_snapshot_t last_snapshot;
+	atomic_bool compacting;
+} mnk_ai_tree_t;
+
+typedef struct {
+	mnk_ai_t* ai;
+	int index;
+	thrd_t thread;
+} mnk_ai_worker_t;
 
 struct mnk_ai_s {
-	monte_t* monte[NUM_MONTE_THREADS];
+	int num_threads;
+	int num_iterations;
+	bool batch_rollouts;
+	bool pin_threads;
+	bool sequential_halving;
+	bool compact_trees;
+	// Receives the trace of the first tree
+	FILE* trace_file;
+	// Tree searched by the next mnk_ai_step
+	int next_step_tree;
+	// Maps the moves of the game to those of the trees, which play the
+	// canonical image of every applied move
+	int symmetry;
+
+	// One tree per worker, workers steal chunks of iterations from each
+	// other's trees once their own is done
+	mnk_ai_tree_t* trees;
+	mnk_ai_worker_t* workers;
+
+	// When set, there are no workers and trees are searched as jobs
+	mnk_scheduler_t* scheduler;
+	uint64_t move_time_ns;
+
+	// Buffers of mnk_ai_snapshot, one entry per cell
+	monte_snapshot_child_t* snapshot_children;
+	mnk_move_t* snapshot_pv;
+	int* snapshot_num_visits;
+	float* snapshot_values;
+
+#ifdef MONTE_ENABLE_SHARED
+	// When set, all trees are views of the same shared tree
+	void* shared_memory;
+	size_t shared_size;
+	char* shared_name;
+	bool owns_shared_memory;
+#endif
+
+	mtx_t mutex;
+	cnd_t start_cond;
+	cnd_t done_cond;
+	int generation;
+	int num_running;
+	// The current generation compacts the trees instead of searching them
+	bool compact;
+	int num_compacting;
+	bool shutdown;
+};
+
+struct mnk_scheduler_s {
+	monte_scheduler_t* scheduler;
+	monte_arena_t* arena;
 };
 
 static void*
 monte_user_alloc(size_t size, size_t alignment, monte_allocator_ctx_t* ctx) {
-	return malloc(size);
+	return monte_arena_alloc(ctx, size, alignment);
 }
 
 float
@@ -37,41 +223,65 @@ monte_user_create_state(const mnk_config_t* config) {
 	return mnk_state_create(config);
 }
 
+static inline size_t
+mnk_state_size(const mnk_config_t* config) {
+	return sizeof(mnk_state_t) + config->width * config->height * 2;
+}
+
+static inline mnk_dims_t
+mnk_dims(const mnk_config_t* config) {
+	return (mnk_dims_t){
+		.width = config->width,
+		.height = config->height,
+		.stride = config->stride,
+	};
+}
+
+MNK_KERNEL void
+mnk_copy_state(mnk_state_t* dst, const mnk_state_t* src, mnk_dims_t dims) {
+	memcpy(dst, src, sizeof(mnk_state_t) + dims.width * dims.height * 2);
+}
+
 static void
 monte_user_copy_state(mnk_state_t* dst, const monte_state_t* src) {
-	memcpy(dst, src, sizeof(mnk_state_t) + src->config.width * src->config.height);
+	MNK_DISPATCH(src, mnk_copy_state(dst, src, dims));
 }
 
-monte_player_id_t
-mnk_state_get(const mnk_state_t* state, int8_t x, int8_t y) {
-	if (
-		   (0 <= x && x < state->config.width)
-		&& (0 <= y && y < state->config.height)
-	) {
-		return state->board[y * state->config.width + x] - 1;
+MNK_KERNEL bool
+mnk_in_bounds(int32_t x, int32_t y, mnk_dims_t dims) {
+	return (0 <= x && x < dims.width)
+		&& (0 <= y && y < dims.height);
+}
+
+MNK_KERNEL monte_player_id_t
+mnk_get(const mnk_state_t* state, int32_t x, int32_t y, mnk_dims_t dims) {
+	if (mnk_in_bounds(x, y, dims)) {
+		return (state->board[y * dims.width + x] & MNK_CELL_STONE_MASK) - 1;
 	} else {
 		return -1;
 	}
 }
 
-void
-mnk_state_set(mnk_state_t* state, int8_t x, int8_t y, monte_player_id_t player) {
-	state->board[y * state->config.width + x] = player + 1;
-	--state->num_spaces;
+monte_player_id_t
+mnk_state_get(const mnk_state_t* state, int8_t x, int8_t y) {
+	return mnk_get(state, x, y, mnk_dims(&state->config));
 }
 
-static monte_index_t
+// Stones of `player` in a row from (x, y), not counting it. Stops at
+// stride - 1, which is all mnk_completes_stride needs.
+MNK_KERNEL int32_t
 mnk_count_stride(
-	mnk_state_t* state,
+	const mnk_state_t* state,
 	monte_player_id_t player,
-	monte_index_t x, monte_index_t y,
-	monte_index_t dir_x, monte_index_t dir_y
+	int32_t x, int32_t y,
+	int32_t dir_x, int32_t dir_y,
+	mnk_dims_t dims
 ) {
-	monte_index_t stride = 0;
+	int32_t stride = 0;
 
 	x += dir_x;
 	y += dir_y;
-	while (mnk_state_get(state, x, y) == player) {
+	while (stride < dims.stride - 1 && mnk_get(state, x, y, dims) == player) {
 		++stride;
 		x += dir_x;
 		y += dir_y;
@@ -80,21 +290,231 @@ mnk_count_stride(
 	return stride;
 }
 
+MNK_KERNEL bool
+mnk_completes_stride(
+	const mnk_state_t* state,
+	monte_player_id_t player,
+	int32_t x, int32_t y,
+	mnk_dims_t dims
+) {
+	int32_t stride = dims.stride - 1;
+	return (mnk_count_stride(state, player, x, y,  1, 0, dims) + mnk_count_stride(state, player, x, y, -1,  0, dims) >= stride)
+		|| (mnk_count_stride(state, player, x, y,  0, 1, dims) + mnk_count_stride(state, player, x, y,  0, -1, dims) >= stride)
+		|| (mnk_count_stride(state, player, x, y,  1, 1, dims) + mnk_count_stride(state, player, x, y, -1, -1, dims) >= stride)
+		|| (mnk_count_stride(state, player, x, y, -1, 1, dims) + mnk_count_stride(state, player, x, y,  1, -1, dims) >= stride);
+}
+
+MNK_KERNEL void
+mnk_update_threat(
+	mnk_state_t* state,
+	int32_t x, int32_t y,
+	monte_player_id_t player,
+	mnk_dims_t dims
+) {
+	int8_t* cell = &state->board[y * dims.width + x];
+	int8_t flag = MNK_CELL_THREAT(player);
+	bool was_threat = (*cell & flag) != 0;
+	bool is_threat = (*cell & MNK_CELL_STONE_MASK) == 0
+		&& mnk_completes_stride(state, player, x, y, dims);
+
+	if (was_threat != is_threat) {
+		*cell ^= flag;
+		state->num_threats[player] += is_threat ? 1 : -1;
+	}
+}
+
+MNK_KERNEL void
+mnk_update_threats_around(
+	mnk_state_t* state,
+	int32_t x, int32_t y,
+	monte_player_id_t player,
+	mnk_dims_t dims
+) {
+	static const int8_t dirs[8][2] = {
+		{  1, 0 }, { -1,  0 },
+		{  0, 1 }, {  0, -1 },
+		{  1, 1 }, { -1, -1 },
+		{ -1, 1 }, {  1, -1 },
+	};
+
+	mnk_update_threat(state, x, y, 0, dims);
+	mnk_update_threat(state, x, y, 1, dims);
+
+	// Only lines through (x, y) changed, and along each of them only the
+	// first cell past the run of `player` stones can complete a stride.
+	for (int i = 0; i < 8; ++i) {
+		int32_t dir_x = dirs[i][0];
+		int32_t dir_y = dirs[i][1];
+		int32_t cx = x + dir_x;
+		int32_t cy = y + dir_y;
+		while (mnk_get(state, cx, cy, dims) == player) {
+			cx += dir_x;
+			cy += dir_y;
+		}
+
+		if (
+			mnk_in_bounds(cx, cy, dims)
+			&& mnk_get(state, cx, cy, dims) == MONTE_INVALID_PLAYER
+		) {
+			mnk_update_threat(state, cx, cy, player, dims);
+		}
+	}
+}
+
+MNK_KERNEL void
+mnk_update_near(mnk_state_t* state, int32_t x, int32_t y, int8_t delta, mnk_dims_t dims) {
+	int32_t distance = state->config.candidate_distance;
+	int32_t width = dims.width;
+	int8_t* near_counts = state->board + width * dims.height;
+	for (int32_t cy = y - distance; cy <= y + distance; ++cy) {
+		for (int32_t cx = x - distance; cx <= x + distance; ++cx) {
+			if (!mnk_in_bounds(cx, cy, dims)) { continue; }
+
+			int32_t index = cy * width + cx;
+			int8_t* cell = &state->board[index];
+			int8_t near_count = near_counts[index] += delta;
+			bool is_near = near_count > 0;
+			if (is_near != ((*cell & MNK_CELL_NEAR) != 0)) {
+				*cell ^= MNK_CELL_NEAR;
+				if ((*cell & MNK_CELL_STONE_MASK) == 0) {
+					state->num_candidates += is_near ? 1 : -1;
+				}
+			}
+		}
+	}
+}
+
+MNK_KERNEL bool
+mnk_is_restricted(const mnk_state_t* state, mnk_dims_t dims) {
+	return state->config.candidate_distance > 0
+		&& state->num_spaces < dims.width * dims.height;
+}
+
+static inline bool
+mnk_is_candidate(int8_t cell, bool restricted) {
+	return (cell & MNK_CELL_STONE_MASK) == 0
+		&& (!restricted || (cell & MNK_CELL_NEAR) != 0);
+}
+
+MNK_KERNEL int16_t
+mnk_num_candidates(const mnk_state_t* state, mnk_dims_t dims) {
+	return mnk_is_restricted(state, dims) ? state->num_candidates : state->num_spaces;
+}
+
+static inline mnk_move_t
+mnk_transform(const mnk_config_t* config, int symmetry, int8_t x, int8_t y) {
+	int8_t max_x = config->width - 1;
+	int8_t max_y = config->height - 1;
+	switch (symmetry) {
+		case MNK_SYMMETRY_ROTATE_180:
+			return (mnk_move_t){ .x = max_x - x, .y = max_y - y };
+		case MNK_SYMMETRY_FLIP_X:
+			return (mnk_move_t){ .x = max_x - x, .y = y };
+		case MNK_SYMMETRY_FLIP_Y:
+			return (mnk_move_t){ .x = x, .y = max_y - y };
+		case MNK_SYMMETRY_ROTATE_90:
+			return (mnk_move_t){ .x = max_y - y, .y = x };
+		case MNK_SYMMETRY_ROTATE_270:
+			return (mnk_move_t){ .x = y, .y = max_x - x };
+		case MNK_SYMMETRY_TRANSPOSE:
+			return (mnk_move_t){ .x = y, .y = x };
+		case MNK_SYMMETRY_ANTI_TRANSPOSE:
+			return (mnk_move_t){ .x = max_y - y, .y = max_x - x };
+		default:
+			return (mnk_move_t){ .x = x, .y = y };
+	}
+}
+
+// Symmetry which maps like `first` followed by `second`
+static int
+mnk_compose_symmetries(int first, int second) {
+	// A corner and the cell next to it tell all the symmetries apart
+	const mnk_config_t square = { .width = 3, .height = 3 };
+	mnk_move_t corner = mnk_transform(&square, first, 0, 0);
+	mnk_move_t edge = mnk_transform(&square, first, 1, 0);
+	corner = mnk_transform(&square, second, corner.x, corner.y);
+	edge = mnk_transform(&square, second, edge.x, edge.y);
+
+	int symmetry = MNK_SYMMETRY_IDENTITY;
+	for (; symmetry < MNK_NUM_SYMMETRIES; ++symmetry) {
+		mnk_move_t corner_image = mnk_transform(&square, symmetry, 0, 0);
+		mnk_move_t edge_image = mnk_transform(&square, symmetry, 1, 0);
+		if (
+			corner_image.x == corner.x && corner_image.y == corner.y
+			&& edge_image.x == edge.x && edge_image.y == edge.y
+		) {
+			break;
+		}
+	}
+
+	return symmetry;
+}
+
+static inline int
+mnk_invert_symmetry(int symmetry) {
+	switch (symmetry) {
+		case MNK_SYMMETRY_ROTATE_90:
+			return MNK_SYMMETRY_ROTATE_270;
+		case MNK_SYMMETRY_ROTATE_270:
+			return MNK_SYMMETRY_ROTATE_90;
+		default:
+			return symmetry;
+	}
+}
+
 static void
-monte_user_apply_move(monte_state_t* state, const monte_move_t* move) {
+mnk_update_symmetries(mnk_state_t* state, int8_t x, int8_t y) {
+	// The board was symmetric before this stone, so its image under a
+	// symmetry is still empty unless it is the same cell. Symmetries which
+	// would be restored by later stones are not tracked.
+	uint8_t symmetries = state->symmetries;
+	for (int symmetry = 1; symmetry < MNK_NUM_SYMMETRIES; ++symmetry) {
+		if ((symmetries & (1 << symmetry)) == 0) { continue; }
+
+		mnk_move_t image = mnk_transform(&state->config, symmetry, x, y);
+		if (image.x != x || image.y != y) {
+			symmetries &= ~(1 << symmetry);
+		}
+	}
+
+	// Each change clears at least one of the 7 non-identity bits
+	if (symmetries != state->symmetries) {
+		uint8_t index = state->num_symmetry_changes++;
+		state->symmetry_changes[index].num_spaces = state->num_spaces;
+		state->symmetry_changes[index].symmetries = state->symmetries;
+		state->symmetries = symmetries;
+	}
+}
+
+MNK_KERNEL void
+mnk_set(mnk_state_t* state, int32_t x, int32_t y, monte_player_id_t player, mnk_dims_t dims) {
+	int8_t* cell = &state->board[y * dims.width + x];
+	state->num_candidates -= (*cell & MNK_CELL_NEAR) != 0;
+	*cell = (*cell & ~MNK_CELL_STONE_MASK) | (player + 1);
+	--state->num_spaces;
+	if (state->config.candidate_distance > 0) {
+		mnk_update_near(state, x, y, 1, dims);
+	}
+	if (state->symmetries != (1 << MNK_SYMMETRY_IDENTITY)) {
+		mnk_update_symmetries(state, x, y);
+	}
+	mnk_update_threats_around(state, x, y, player, dims);
+}
+
+void
+mnk_state_set(mnk_state_t* state, int8_t x, int8_t y, monte_player_id_t player) {
+	MNK_DISPATCH(state, mnk_set(state, x, y, player, dims));
+}
+
+MNK_KERNEL void
+mnk_apply_move(mnk_state_t* state, const mnk_move_t* move, mnk_dims_t dims) {
 	if (state->player == MONTE_INVALID_PLAYER) { return; }
 
 	monte_player_id_t player = state->player;
-	int8_t x = move->x;
-	int8_t y = move->y;
-	int8_t stride = state->config.stride - 1;
-	mnk_state_set(state, x, y, player);
-	if (
-		   (mnk_count_stride(state, player, x, y,  1, 0) + mnk_count_stride(state, player, x, y, -1,  0) >= stride)
-		|| (mnk_count_stride(state, player, x, y,  0, 1) + mnk_count_stride(state, player, x, y,  0, -1) >= stride)
-		|| (mnk_count_stride(state, player, x, y,  1, 1) + mnk_count_stride(state, player, x, y, -1, -1) >= stride)
-		|| (mnk_count_stride(state, player, x, y, -1, 1) + mnk_count_stride(state, player, x, y,  1, -1) >= stride)
-	) {
+	int32_t x = move->x;
+	int32_t y = move->y;
+	mnk_set(state, x, y, player, dims);
+	if (mnk_completes_stride(state, player, x, y, dims)) {
 		state->player = MONTE_INVALID_PLAYER;
 		state->winner = player;
 	} else if (state->num_spaces == 0) {
@@ -106,7 +526,47 @@ monte_user_apply_move(monte_state_t* state, const monte_move_t* move) {
 }
 
 static void
-monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info) {
+monte_user_apply_move(monte_state_t* state, const monte_move_t* move) {
+	MNK_DISPATCH(state, mnk_apply_move(state, move, dims));
+}
+
+#ifdef MONTE_ENABLE_UNDO
+MNK_KERNEL void
+mnk_undo_move(mnk_state_t* state, const mnk_move_t* move, mnk_dims_t dims) {
+	int32_t x = move->x;
+	int32_t y = move->y;
+	int8_t* cell = &state->board[y * dims.width + x];
+	monte_player_id_t player = (*cell & MNK_CELL_STONE_MASK) - 1;
+
+	uint8_t num_symmetry_changes = state->num_symmetry_changes;
+	if (
+		num_symmetry_changes > 0
+		&& state->symmetry_changes[num_symmetry_changes - 1].num_spaces == state->num_spaces
+	) {
+		state->symmetries = state->symmetry_changes[num_symmetry_changes - 1].symmetries;
+		state->num_symmetry_changes = num_symmetry_changes - 1;
+	}
+
+	*cell &= ~MNK_CELL_STONE_MASK;
+	state->num_candidates += (*cell & MNK_CELL_NEAR) != 0;
+	++state->num_spaces;
+	if (state->config.candidate_distance > 0) {
+		mnk_update_near(state, x, y, -1, dims);
+	}
+	mnk_update_threats_around(state, x, y, player, dims);
+
+	state->player = player;
+	state->winner = MONTE_INVALID_PLAYER;
+}
+
+static void
+monte_user_undo_move(monte_state_t* state, const monte_move_t* move) {
+	MNK_DISPATCH(state, mnk_undo_move(state, move, dims));
+}
+#endif
+
+static inline void
+mnk_inspect(const mnk_state_t* state, monte_state_info_t* info) {
 	if (state->num_spaces == 0) {
 		info->current_player = MONTE_INVALID_PLAYER;
 		info->scores[0] = 0;
@@ -123,47 +583,668 @@ monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info) {
 }
 
 static void
-monte_user_iterate_moves(const monte_state_t* state, monte_iterator_t* itr) {
-	for (int8_t x = 0; x < state->config.width; ++x) {
-		for (int8_t y = 0; y < state->config.height; ++y) {
-			if (mnk_state_get(state, x, y) == MONTE_INVALID_PLAYER) {
-				monte_submit_move(itr, &(mnk_move_t) {
-					.x = x,
-					.y = y,
-				});
+monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info) {
+	mnk_inspect(state, info);
+}
+
+static void
+monte_user_apply_and_inspect(
+	monte_state_t* state,
+	const monte_move_t* move,
+	monte_state_info_t* info
+) {
+	MNK_DISPATCH(state, mnk_apply_move(state, move, dims));
+	mnk_inspect(state, info);
+}
+
+MNK_KERNEL bool
+mnk_next_move(const mnk_state_t* state, int16_t* cursor, mnk_move_t* move, mnk_dims_t dims) {
+	bool restricted = mnk_is_restricted(state, dims);
+	int32_t width = dims.width;
+	int32_t num_cells = width * dims.height;
+	for (int32_t i = *cursor; i < num_cells; ++i) {
+		if (mnk_is_candidate(state->board[i], restricted)) {
+			*move = (mnk_move_t){
+				.x = i % width,
+				.y = i / width,
+			};
+			*cursor = i + 1;
+			return true;
+		}
+	}
+
+	*cursor = num_cells;
+	return false;
+}
+
+static bool
+monte_user_next_move(const monte_state_t* state, int16_t* cursor, mnk_move_t* move) {
+	MNK_DISPATCH(state, return mnk_next_move(state, cursor, move, dims));
+}
+
+// Static evaluation
+//
+// Every window of `stride` cells which holds stones of only one player is an
+// open line for that player, worth more the fuller it is. A player to move
+// with a threat wins, and so does an opponent holding two threats since only
+// one can be blocked.
+
+// Lines with more stones score as this many, which keeps the shift in
+// mnk_line_score within an int on long strides
+#define MNK_EVAL_MAX_LINE_STONES 16
+
+static inline float
+mnk_line_score(int32_t num_stones) {
+	if (num_stones > MNK_EVAL_MAX_LINE_STONES) { num_stones = MNK_EVAL_MAX_LINE_STONES; }
+	return (float)((int32_t)1 << (2 * (num_stones - 1)));
+}
+
+MNK_KERNEL void
+mnk_evaluate_state(const mnk_state_t* state, float* values, mnk_dims_t dims) {
+	monte_player_id_t player = state->player;
+	monte_player_id_t opponent = 1 - player;
+	if (state->num_threats[player] > 0) {
+		values[player] = 1.f;
+		values[opponent] = -1.f;
+		return;
+	}
+
+	if (state->num_threats[opponent] > 1) {
+		values[player] = -1.f;
+		values[opponent] = 1.f;
+		return;
+	}
+
+	static const int8_t dirs[4][2] = { { 1, 0 }, { 0, 1 }, { 1, 1 }, { -1, 1 } };
+	int32_t width = dims.width;
+	int32_t height = dims.height;
+	int32_t stride = dims.stride;
+	float line_scores[2] = { 0.f, 0.f };
+	for (int i = 0; i < 4; ++i) {
+		int32_t dir_x = dirs[i][0];
+		int32_t dir_y = dirs[i][1];
+		for (int32_t y = 0; y < height; ++y) {
+			for (int32_t x = 0; x < width; ++x) {
+				int32_t end_x = x + dir_x * (stride - 1);
+				int32_t end_y = y + dir_y * (stride - 1);
+				if (!mnk_in_bounds(end_x, end_y, dims)) { continue; }
+
+				int32_t counts[2] = { 0, 0 };
+				for (int32_t j = 0; j < stride; ++j) {
+					monte_player_id_t stone = mnk_get(state, x + dir_x * j, y + dir_y * j, dims);
+					if (stone != MONTE_INVALID_PLAYER) { ++counts[stone]; }
+				}
+
+				if (counts[0] > 0 && counts[1] == 0) {
+					line_scores[0] += mnk_line_score(counts[0]);
+				} else if (counts[1] > 0 && counts[0] == 0) {
+					line_scores[1] += mnk_line_score(counts[1]);
+				}
+			}
+		}
+	}
+
+	float value = (line_scores[0] - line_scores[1]) / (line_scores[0] + line_scores[1] + 1.f);
+	values[0] = value;
+	values[1] = -value;
+}
+
+static void
+monte_user_evaluate_state(const mnk_state_t* state, float* values) {
+	MNK_DISPATCH(state, mnk_evaluate_state(state, values, dims));
+}
+
+// Lockstep playouts
+//
+// Up to MNK_BATCH_LANES games are advanced together, one move per lane per
+// step. Boards are stored lane-interleaved (cell-major, lane-minor) inside a
+// one-cell sentinel border, so the threat updates are a fixed number of
+// straight passes over the lanes with no bounds checks, which the compiler can
+// turn into vector gathers and compares. Finished lanes are masked out until
+// the whole group is done.
+//
+// The games are those of monte_simulate with mnk_pick_rollout_move: wins are
+// taken and blocked, other moves are random among the candidates and playouts
+// stop at max_depth. Cells carry the same flags as mnk_state_t.board, so a
+// game is won exactly when the player to move holds a threat.
+
+enum {
+	MNK_LANE_EMPTY = 0,
+	// 1 and 2 are the stones of player 0 and 1, same as mnk_state_t.board
+	MNK_LANE_BORDER = 3,
+	MNK_LANE_NONE = 4,
+};
+
+static inline uint32_t
+mnk_lane_rng_next(uint32_t* state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Count the stones of each lane in a row from start, not counting it, up to
+// max_count. `end` is the first cell past them.
+MNK_KERNEL void
+mnk_lane_walk(
+	int8_t (*cells)[MNK_BATCH_LANES],
+	const int32_t start[],
+	const int8_t mask[],
+	const int8_t stone[],
+	int32_t step,
+	int32_t max_count,
+	int32_t count[],
+	int32_t end[]
+) {
+	int8_t alive[MNK_BATCH_LANES];
+	for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+		count[lane] = 0;
+		end[lane] = start[lane] + step;
+		alive[lane] = mask[lane];
+	}
+
+	for (int32_t i = 0; i < max_count; ++i) {
+		int8_t any_alive = 0;
+		for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+			int8_t same = alive[lane]
+				& ((cells[end[lane]][lane] & MNK_CELL_STONE_MASK) == stone[lane]);
+			count[lane] += same;
+			end[lane] = same ? end[lane] + step : end[lane];
+			alive[lane] = same;
+			any_alive |= same;
+		}
+		// Runs are mostly short
+		if (!any_alive) { break; }
+	}
+}
+
+// Lists of cells per lane. Cells are never removed in the middle, entries for
+// cells which have been filled since are dropped when they come up.
+typedef struct {
+	int16_t (*cells)[MNK_BATCH_LANES];
+	int32_t size[MNK_BATCH_LANES];
+} mnk_lane_list_t;
+
+static inline void
+mnk_lane_push(mnk_lane_list_t* list, int lane, int32_t cell) {
+	list->cells[list->size[lane]++][lane] = cell;
+}
+
+// Random empty cell from the list, -1 if there is none
+static inline int32_t
+mnk_lane_pick(mnk_lane_list_t* list, int8_t (*cells)[MNK_BATCH_LANES], int lane, uint32_t* rng) {
+	while (list->size[lane] > 0) {
+		int32_t last = --list->size[lane];
+		int32_t pick = (int32_t)(((uint64_t)mnk_lane_rng_next(rng) * (uint64_t)(last + 1)) >> 32);
+		int32_t cell = list->cells[pick][lane];
+		list->cells[pick][lane] = list->cells[last][lane];
+		if ((cells[cell][lane] & MNK_CELL_STONE_MASK) == MNK_LANE_EMPTY) { return cell; }
+	}
+
+	return -1;
+}
+
+// Last cell of the list which still has `flag`, -1 if there is none
+static inline int32_t
+mnk_lane_find(mnk_lane_list_t* list, int8_t (*cells)[MNK_BATCH_LANES], int lane, int8_t flag) {
+	while (list->size[lane] > 0) {
+		int32_t cell = list->cells[list->size[lane] - 1][lane];
+		if (cells[cell][lane] & flag) { return cell; }
+		--list->size[lane];
+	}
+
+	return -1;
+}
+
+// Scratch memory of mnk_simulate_lanes, which is too large for the stack on
+// big boards. Every thread playing batches keeps its own, grown to the
+// largest board it has seen and freed when it exits.
+typedef struct {
+	size_t size;
+	int16_t memory[];
+} mnk_lane_scratch_t;
+
+static once_flag mnk_lane_scratch_once = ONCE_FLAG_INIT;
+static tss_t mnk_lane_scratch_key;
+
+static void
+mnk_create_lane_scratch_key(void) {
+	tss_create(&mnk_lane_scratch_key, free);
+}
+
+static inline size_t
+mnk_lane_scratch_size(const mnk_config_t* config) {
+	size_t area = (size_t)config->width * config->height;
+	size_t padded_area = (size_t)(config->width + 2) * (config->height + 2);
+	return (sizeof(int16_t) * 3 * area + padded_area) * MNK_BATCH_LANES;
+}
+
+static void*
+mnk_lane_scratch(size_t size) {
+	call_once(&mnk_lane_scratch_once, mnk_create_lane_scratch_key);
+	mnk_lane_scratch_t* scratch = tss_get(mnk_lane_scratch_key);
+	if (scratch == NULL || scratch->size < size) {
+		free(scratch);
+		scratch = malloc(sizeof(mnk_lane_scratch_t) + size);
+		scratch->size = size;
+		tss_set(mnk_lane_scratch_key, scratch);
+	}
+
+	return scratch->memory;
+}
+
+// Not a kernel: it is too large to gain from being inlined for every size
+static void
+mnk_simulate_lanes(
+	mnk_state_t* const states[],
+	monte_index_t num_states,
+	monte_index_t max_depth,
+	rnd_pcg_t* rng_state,
+	float* values,
+	void* scratch,
+	mnk_dims_t dims
+) {
+	int32_t width = dims.width;
+	int32_t height = dims.height;
+	int32_t area = width * height;
+	int32_t padded_width = width + 2;
+	int32_t padded_area = padded_width * (height + 2);
+	int32_t run_length = dims.stride - 1;
+	int32_t distance = states[0]->config.candidate_distance;
+	const int32_t dirs[4] = { 1, padded_width, padded_width + 1, padded_width - 1 };
+
+	// Empty cells random moves are picked from: all of them, or the ones
+	// within candidate_distance of a stone
+	int16_t (*candidate_cells)[MNK_BATCH_LANES] = scratch;
+	mnk_lane_list_t candidates = { .cells = candidate_cells };
+	// Cells in the order they became threats, by player
+	mnk_lane_list_t threats[2] = {
+		{ .cells = candidate_cells + area },
+		{ .cells = candidate_cells + 2 * area },
+	};
+	int8_t (*cells)[MNK_BATCH_LANES] = (int8_t (*)[MNK_BATCH_LANES])(candidate_cells + 3 * area);
+	int32_t num_threats[2][MNK_BATCH_LANES];
+	int32_t num_spaces[MNK_BATCH_LANES];
+	int32_t depth[MNK_BATCH_LANES];
+	int8_t stone[MNK_BATCH_LANES];
+	int8_t winner[MNK_BATCH_LANES];
+	int8_t active[MNK_BATCH_LANES];
+	int8_t truncated[MNK_BATCH_LANES];
+	// The first stone restricts moves to the cells around it
+	int8_t unrestricted[MNK_BATCH_LANES];
+	int32_t pos[MNK_BATCH_LANES];
+	uint32_t rng[MNK_BATCH_LANES];
+
+	memset(cells, MNK_LANE_BORDER, sizeof(*cells) * padded_area);
+	for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+		candidates.size[lane] = 0;
+		threats[0].size[lane] = 0;
+		threats[1].size[lane] = 0;
+		num_threats[0][lane] = 0;
+		num_threats[1][lane] = 0;
+		num_spaces[lane] = 0;
+		depth[lane] = 0;
+		stone[lane] = MNK_LANE_NONE;
+		winner[lane] = MONTE_INVALID_PLAYER;
+		active[lane] = 0;
+		truncated[lane] = 0;
+		unrestricted[lane] = 0;
+		pos[lane] = padded_width + 1;
+		rng[lane] = rnd_pcg_next(rng_state) | 1;
+	}
+
+	for (monte_index_t lane = 0; lane < num_states; ++lane) {
+		const mnk_state_t* state = states[lane];
+		bool restricted = mnk_is_restricted(state, dims);
+		for (int32_t y = 0; y < height; ++y) {
+			for (int32_t x = 0; x < width; ++x) {
+				int32_t cell = (y + 1) * padded_width + (x + 1);
+				int8_t value = state->board[y * width + x];
+				cells[cell][lane] = value;
+				if ((value & MNK_CELL_STONE_MASK) != MNK_LANE_EMPTY) { continue; }
+
+				++num_spaces[lane];
+				if (mnk_is_candidate(value, restricted)) {
+					mnk_lane_push(&candidates, lane, cell);
+				}
+				for (int player = 0; player < 2; ++player) {
+					if (value & MNK_CELL_THREAT(player)) {
+						mnk_lane_push(&threats[player], lane, cell);
+					}
+				}
+			}
+		}
+
+		if (state->player == MONTE_INVALID_PLAYER) {
+			winner[lane] = state->winner;
+		} else {
+			num_threats[0][lane] = state->num_threats[0];
+			num_threats[1][lane] = state->num_threats[1];
+			stone[lane] = state->player + 1;
+			active[lane] = 1;
+			unrestricted[lane] = distance > 0 && !restricted;
+		}
+	}
+
+	for (;;) {
+		int32_t num_active = 0;
+		for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+			num_active += active[lane];
+		}
+		if (num_active == 0) { break; }
+
+		// Move choice and board update
+		int8_t moved[MNK_BATCH_LANES] = { 0 };
+		for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+			if (!active[lane]) { continue; }
+
+			int8_t player = stone[lane] - 1;
+			int8_t opponent = 1 - player;
+			if (num_threats[player][lane] > 0) {
+				// Decisive move. As in mnk_inspect, filling the board is a draw.
+				winner[lane] = num_spaces[lane] > 1 ? player : MONTE_INVALID_PLAYER;
+				active[lane] = 0;
+				continue;
+			}
+
+			// Anti-decisive move, or a random one
+			int32_t cell = num_threats[opponent][lane] > 0
+				? mnk_lane_find(&threats[opponent], cells, lane, MNK_CELL_THREAT(opponent))
+				: mnk_lane_pick(&candidates, cells, lane, &rng[lane]);
+			if (cell < 0) {
+				active[lane] = 0;
+				continue;
 			}
+
+			int8_t value = cells[cell][lane];
+			num_threats[opponent][lane] -= (value & MNK_CELL_THREAT(opponent)) != 0;
+			cells[cell][lane] = (value & MNK_CELL_NEAR) | stone[lane];
+			--num_spaces[lane];
+			++depth[lane];
+			pos[lane] = cell;
+			moved[lane] = 1;
+
+			if (distance == 0) { continue; }
+
+			int32_t x = cell % padded_width - 1;
+			int32_t y = cell / padded_width - 1;
+			for (int32_t cy = y - distance; cy <= y + distance; ++cy) {
+				for (int32_t cx = x - distance; cx <= x + distance; ++cx) {
+					if (!mnk_in_bounds(cx, cy, dims)) { continue; }
+
+					int32_t near_cell = (cy + 1) * padded_width + (cx + 1);
+					int8_t near_value = cells[near_cell][lane];
+					if (near_value & MNK_CELL_NEAR) { continue; }
+
+					cells[near_cell][lane] = near_value | MNK_CELL_NEAR;
+					if ((near_value & MNK_CELL_STONE_MASK) == MNK_LANE_EMPTY && !unrestricted[lane]) {
+						mnk_lane_push(&candidates, lane, near_cell);
+					}
+				}
+			}
+
+			if (unrestricted[lane]) {
+				candidates.size[lane] = 0;
+				for (int32_t i = 0; i < padded_area; ++i) {
+					if ((cells[i][lane] & (MNK_CELL_STONE_MASK | MNK_CELL_NEAR)) == MNK_CELL_NEAR) {
+						mnk_lane_push(&candidates, lane, i);
+					}
+				}
+				unrestricted[lane] = 0;
+			}
+		}
+
+		// Threat update: only lines through the new stone changed, and along
+		// each of them only the first cell past the run of the mover's stones
+		// on either side can now complete a stride
+		for (int axis = 0; axis < 4; ++axis) {
+			int32_t step = dirs[axis];
+			int32_t ahead[MNK_BATCH_LANES];
+			int32_t behind[MNK_BATCH_LANES];
+			int32_t ahead_end[MNK_BATCH_LANES];
+			int32_t behind_end[MNK_BATCH_LANES];
+			mnk_lane_walk(cells, pos, moved, stone, step, run_length, ahead, ahead_end);
+			mnk_lane_walk(cells, pos, moved, stone, -step, run_length, behind, behind_end);
+
+			// Past empty cells only, start the others somewhere harmless
+			int8_t ahead_open[MNK_BATCH_LANES];
+			int8_t behind_open[MNK_BATCH_LANES];
+			for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+				ahead_open[lane] = moved[lane]
+					& ((cells[ahead_end[lane]][lane] & MNK_CELL_STONE_MASK) == MNK_LANE_EMPTY);
+				behind_open[lane] = moved[lane]
+					& ((cells[behind_end[lane]][lane] & MNK_CELL_STONE_MASK) == MNK_LANE_EMPTY);
+				ahead_end[lane] = ahead_open[lane] ? ahead_end[lane] : pos[lane];
+				behind_end[lane] = behind_open[lane] ? behind_end[lane] : pos[lane];
+			}
+
+			int32_t beyond_ahead[MNK_BATCH_LANES];
+			int32_t beyond_behind[MNK_BATCH_LANES];
+			int32_t unused[MNK_BATCH_LANES];
+			mnk_lane_walk(cells, ahead_end, ahead_open, stone, step, run_length, beyond_ahead, unused);
+			mnk_lane_walk(cells, behind_end, behind_open, stone, -step, run_length, beyond_behind, unused);
+
+			for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+				if (!moved[lane]) { continue; }
+
+				int8_t player = stone[lane] - 1;
+				int8_t flag = MNK_CELL_THREAT(player);
+				int32_t line = ahead[lane] + 1 + behind[lane];
+				int32_t ends[2] = { ahead_end[lane], behind_end[lane] };
+				bool completes[2] = {
+					ahead_open[lane] && line + beyond_ahead[lane] >= run_length,
+					behind_open[lane] && line + beyond_behind[lane] >= run_length,
+				};
+				for (int side = 0; side < 2; ++side) {
+					if (completes[side] && (cells[ends[side]][lane] & flag) == 0) {
+						cells[ends[side]][lane] |= flag;
+						mnk_lane_push(&threats[player], lane, ends[side]);
+						++num_threats[player][lane];
+					}
+				}
+			}
+		}
+
+		for (int lane = 0; lane < MNK_BATCH_LANES; ++lane) {
+			if (!moved[lane]) { continue; }
+
+			stone[lane] = 3 - stone[lane];
+			if (num_spaces[lane] == 0) {
+				active[lane] = 0;
+			} else if (depth[lane] == max_depth) {
+				truncated[lane] = 1;
+				active[lane] = 0;
+			}
+		}
+	}
+
+	for (monte_index_t lane = 0; lane < num_states; ++lane) {
+		float* lane_values = values + lane * 2;
+		if (truncated[lane]) {
+			// Write back only what the evaluation reads
+			mnk_state_t* state = states[lane];
+			for (int32_t y = 0; y < height; ++y) {
+				for (int32_t x = 0; x < width; ++x) {
+					state->board[y * width + x] = cells[(y + 1) * padded_width + (x + 1)][lane];
+				}
+			}
+			state->player = stone[lane] - 1;
+			state->num_threats[0] = num_threats[0][lane];
+			state->num_threats[1] = num_threats[1][lane];
+			mnk_evaluate_state(state, lane_values, dims);
+		} else if (winner[lane] == MONTE_INVALID_PLAYER) {
+			lane_values[0] = 0.f;
+			lane_values[1] = 0.f;
+		} else {
+			lane_values[winner[lane]] = 1.f;
+			lane_values[1 - winner[lane]] = -1.f;
+		}
+	}
+}
+
+static void
+monte_user_simulate_batch(
+	mnk_state_t* const states[],
+	monte_index_t num_states,
+	monte_index_t max_depth,
+	monte_rng_state_t* rng_state,
+	float* values
+) {
+	void* scratch = mnk_lane_scratch(mnk_lane_scratch_size(&states[0]->config));
+	for (monte_index_t i = 0; i < num_states; i += MNK_BATCH_LANES) {
+		monte_index_t num_lanes = num_states - i;
+		if (num_lanes > MNK_BATCH_LANES) { num_lanes = MNK_BATCH_LANES; }
+		MNK_DISPATCH(
+			states[0],
+			mnk_simulate_lanes(
+				states + i, num_lanes, max_depth, rng_state, values + i * 2, scratch, dims
+			)
+		);
+	}
+}
+
+MNK_KERNEL bool
+mnk_find_threat(
+	const mnk_state_t* state,
+	monte_player_id_t player,
+	mnk_move_t* move,
+	mnk_dims_t dims
+) {
+	int8_t flag = MNK_CELL_THREAT(player);
+	int32_t width = dims.width;
+	int32_t num_cells = width * dims.height;
+	for (int32_t i = 0; i < num_cells; ++i) {
+		if (state->board[i] & flag) {
+			*move = (mnk_move_t){
+				.x = i % width,
+				.y = i / width,
+			};
+			return true;
+		}
+	}
+
+	return false;
+}
+
+MNK_KERNEL bool
+mnk_pick_rollout_move(
+	const mnk_state_t* state,
+	rnd_pcg_t* rng_state,
+	mnk_move_t* move,
+	mnk_dims_t dims
+) {
+	monte_player_id_t player = state->player;
+
+	// Decisive move: win right away
+	if (state->num_threats[player] > 0) {
+		return mnk_find_threat(state, player, move, dims);
+	}
+
+	// Anti-decisive move: block the opponent's win
+	if (state->num_threats[1 - player] > 0) {
+		return mnk_find_threat(state, 1 - player, move, dims);
+	}
+
+	bool restricted = mnk_is_restricted(state, dims);
+	int16_t pick = rnd_pcg_range(rng_state, 0, mnk_num_candidates(state, dims) - 1);
+	int32_t width = dims.width;
+	int32_t num_cells = width * dims.height;
+	for (int32_t i = 0; i < num_cells; ++i) {
+		if (mnk_is_candidate(state->board[i], restricted) && pick-- == 0) {
+			*move = (mnk_move_t){
+				.x = i % width,
+				.y = i / width,
+			};
+			return true;
 		}
 	}
+
+	return false;
 }
 
 static bool
-monte_user_moves_equal(const monte_move_t* lhs, const monte_move_t* rhs) {
-	return (lhs->x == rhs->x) && (lhs->y == rhs->y);
+monte_user_pick_rollout_move(const mnk_state_t* state, rnd_pcg_t* rng_state, mnk_move_t* move) {
+	MNK_DISPATCH(state, return mnk_pick_rollout_move(state, rng_state, move, dims));
 }
 
-static uint64_t
-splittable64(uint64_t x) {
-    x ^= x >> 30;
-    x *= 0xbf58476d1ce4e5b9U;
-    x ^= x >> 27;
-    x *= 0x94d049bb133111ebU;
-    x ^= x >> 31;
-    return x;
+static float
+monte_user_move_priority(const mnk_state_t* state, const mnk_move_t* move) {
+	int8_t cell = state->board[move->y * state->config.width + move->x];
+	if (cell & (MNK_CELL_THREAT(0) | MNK_CELL_THREAT(1))) { return 16.f; }
+
+	int8_t num_neighbors = 0;
+	for (int8_t y = move->y - 1; y <= move->y + 1; ++y) {
+		for (int8_t x = move->x - 1; x <= move->x + 1; ++x) {
+			num_neighbors += mnk_state_get(state, x, y) != MONTE_INVALID_PLAYER;
+		}
+	}
+
+	return (float)num_neighbors;
 }
 
-static monte_hash_t
-monte_user_hash_move(const monte_move_t* move) {
-	return splittable64((move->x << 8) | move->x);
+// Symmetry of the state which maps the move to its canonical image, the one
+// with the lowest index
+static int
+mnk_canonical_symmetry(const mnk_state_t* state, const mnk_move_t* move) {
+	int8_t width = state->config.width;
+	int canonical_symmetry = MNK_SYMMETRY_IDENTITY;
+	int16_t canonical_index = move->y * width + move->x;
+	for (int symmetry = 1; symmetry < MNK_NUM_SYMMETRIES; ++symmetry) {
+		if ((state->symmetries & (1 << symmetry)) == 0) { continue; }
+
+		mnk_move_t image = mnk_transform(&state->config, symmetry, move->x, move->y);
+		int16_t index = image.y * width + image.x;
+		if (index < canonical_index) {
+			canonical_symmetry = symmetry;
+			canonical_index = index;
+		}
+	}
+
+	return canonical_symmetry;
+}
+
+static void
+monte_user_canonicalize(const mnk_state_t* state, mnk_move_t* move) {
+	int symmetry = mnk_canonical_symmetry(state, move);
+	*move = mnk_transform(&state->config, symmetry, move->x, move->y);
+}
+
+static bool
+monte_user_moves_equal(const monte_move_t* lhs, const monte_move_t* rhs) {
+	return (lhs->x == rhs->x) && (lhs->y == rhs->y);
 }
 
 mnk_state_t*
 mnk_state_create(const mnk_config_t* config) {
-	mnk_state_t* state = malloc(sizeof(mnk_state_t) + config->width * config->height);
+	mnk_state_t* state = malloc(mnk_state_size(config));
 	state->player = 0;
 	state->winner = MONTE_INVALID_PLAYER;
 	state->num_spaces = config->width * config->height;
+	state->num_threats[0] = 0;
+	state->num_threats[1] = 0;
+	state->num_candidates = 0;
+	state->symmetries = config->width == config->height
+		? (1 << MNK_NUM_SYMMETRIES) - 1
+		: (1 << MNK_SYMMETRY_ROTATE_90) - 1;
+	state->num_symmetry_changes = 0;
 	state->config = *config;
-	memset(state->board, 0, config->width * config->height);
+	if (state->config.candidate_distance > MNK_MAX_CANDIDATE_DISTANCE) {
+		state->config.candidate_distance = MNK_MAX_CANDIDATE_DISTANCE;
+	}
+	state->kernel = MNK_KERNEL_GENERIC;
+	for (int kernel = MNK_KERNEL_GENERIC + 1; kernel < MNK_NUM_KERNELS; ++kernel) {
+		const mnk_dims_t* dims = &mnk_kernel_dims[kernel];
+		if (
+			dims->width == config->width
+			&& dims->height == config->height
+			&& dims->stride == config->stride
+		) {
+			state->kernel = kernel;
+		}
+	}
+	memset(state->board, 0, config->width * config->height * 2);
 	return state;
 }
 
@@ -177,64 +1258,634 @@ mnk_state_apply(mnk_state_t* state, mnk_move_t move) {
 	monte_user_apply_move(state, &move);
 }
 
+static void
+mnk_ai_run_chunk(mnk_ai_t* ai, mnk_ai_tree_t* tree, int num_iterations) {
+	int i = 0;
+	if (ai->batch_rollouts) {
+		for (; i + MONTE_BATCH_SIZE <= num_iterations; i += MONTE_BATCH_SIZE) {
+			monte_iterate_batch(tree->monte);
+		}
+	}
+	for (; i < num_iterations; ++i) {
+		monte_iterate(tree->monte);
+	}
+}
+
+static void
+mnk_ai_run_chunks(mnk_ai_t* ai, int index) {
+	int num_trees = ai->num_threads;
+	for (;;) {
+		bool has_work = false;
+		bool did_work = false;
+		// Start from our own tree, then steal from the next ones
+		for (int i = 0; i < num_trees && !did_work; ++i) {
+			mnk_ai_tree_t* tree = &ai->trees[(index + i) % num_trees];
+			if (atomic_load_explicit(&tree->num_chunks_left, memory_order_relaxed) <= 0) {
+				continue;
+			}
+
+			has_work = true;
+			if (atomic_flag_test_and_set_explicit(&tree->busy, memory_order_acquire)) {
+				continue;
+			}
+
+			int num_chunks_left;
+			while (
+				(num_chunks_left = atomic_fetch_sub_explicit(
+					&tree->num_chunks_left, 1, memory_order_relaxed
+				)) > 0
+			) {
+				// The last chunk runs what is left of the iterations
+				int num_iterations = num_chunks_left > 1
+					? MNK_AI_CHUNK_SIZE
+					: (ai->num_iterations - 1) % MNK_AI_CHUNK_SIZE + 1;
+				mnk_ai_run_chunk(ai, tree, num_iterations);
+				did_work = true;
+				// Give a stolen tree back as soon as possible
+				if (i != 0) { break; }
+			}
+			atomic_flag_clear_explicit(&tree->busy, memory_order_release);
+		}
+
+		if (!has_work) { return; }
+		if (!did_work) { thrd_yield(); }
+	}
+}
+
+static void
+mnk_ai_pin_thread(int index) {
+#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) { return; }
+
+	int num_cpus = CPU_COUNT(&allowed);
+	if (num_cpus == 0) { return; }
+
+	int target = index % num_cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed)) { continue; }
+		if (target-- > 0) { continue; }
+
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		CPU_SET(cpu, &cpu_set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+		return;
+	}
+#else
+	(void)index;
+#endif
+}
+
+static int
+mnk_ai_worker_main(void* userdata) {
+	mnk_ai_worker_t* worker = userdata;
+	mnk_ai_t* ai = worker->ai;
+
+	if (ai->pin_threads) {
+		mnk_ai_pin_thread(worker->index);
+	}
+	// New nodes are allocated on this thread, keep them on its NUMA node
+	monte_arena_bind(ai->trees[worker->index].arena);
+
+	int generation = 0;
+	for (;;) {
+		mtx_lock(&ai->mutex);
+		while (ai->generation == generation && !ai->shutdown) {
+			cnd_wait(&ai->start_cond, &ai->mutex);
+		}
+		if (ai->shutdown) {
+			mtx_unlock(&ai->mutex);
+			return 0;
+		}
+		generation = ai->generation;
+		bool compact = ai->compact;
+		mtx_unlock(&ai->mutex);
+
+		if (compact) {
+			mnk_ai_tree_t* tree = &ai->trees[worker->index];
+			monte_compact(tree->monte);
+			atomic_store_explicit(&tree->compacting, false, memory_order_release);
+
+			mtx_lock(&ai->mutex);
+			if (--ai->num_compacting == 0) {
+				cnd_broadcast(&ai->done_cond);
+			}
+			mtx_unlock(&ai->mutex);
+			continue;
+		}
+
+		mnk_ai_run_chunks(ai, worker->index);
+
+		mtx_lock(&ai->mutex);
+		if (--ai->num_running == 0) {
+			cnd_signal(&ai->done_cond);
+		}
+		mtx_unlock(&ai->mutex);
+	}
+}
+
+mnk_scheduler_t*
+mnk_scheduler_create(int num_threads) {
+	if (num_threads <= 0) {
+		num_threads = MNK_AI_DEFAULT_NUM_THREADS;
+#ifdef __linux__
+		long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (num_cpus > 0) { num_threads = (int)num_cpus; }
+#endif
+	}
+
+	// The scheduler is tiny, a single huge page is plenty
+	monte_arena_t* arena = monte_arena_create(1);
+	mnk_scheduler_t* scheduler = malloc(sizeof(mnk_scheduler_t));
+	*scheduler = (mnk_scheduler_t){
+		.scheduler = monte_scheduler_create((monte_scheduler_config_t){
+			.num_workers = num_threads,
+			.allocator_ctx = arena,
+		}),
+		.arena = arena,
+	};
+	return scheduler;
+}
+
+void
+mnk_scheduler_destroy(mnk_scheduler_t* scheduler) {
+	monte_scheduler_destroy(scheduler->scheduler);
+	monte_arena_destroy(scheduler->arena);
+	free(scheduler);
+}
+
+static void
+mnk_ai_job_done(monte_job_t* job) {
+	mnk_ai_t* ai = job->userdata;
+
+	mtx_lock(&ai->mutex);
+	if (--ai->num_running == 0) {
+		cnd_signal(&ai->done_cond);
+	}
+	mtx_unlock(&ai->mutex);
+}
+
+#ifdef MONTE_ENABLE_SHARED
+static bool
+mnk_ai_map_shared_memory(mnk_ai_t* ai, const char* name, size_t size) {
+	// Whoever creates the segment initializes the tree in it
+	bool owner = true;
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		owner = false;
+		fd = shm_open(name, O_RDWR, 0);
+	}
+	if (fd < 0) { return false; }
+
+	if (owner) {
+		if (ftruncate(fd, (off_t)size) != 0) {
+			close(fd);
+			shm_unlink(name);
+			return false;
+		}
+	} else {
+		struct stat stat;
+		for (;;) {
+			if (fstat(fd, &stat) != 0) {
+				close(fd);
+				return false;
+			}
+			if (stat.st_size > 0) { break; }
+
+			// The owner has not sized it yet
+			thrd_sleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+		}
+		size = (size_t)stat.st_size;
+	}
+
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED) {
+		if (owner) { shm_unlink(name); }
+		return false;
+	}
+
+	ai->shared_memory = memory;
+	ai->shared_size = size;
+	ai->shared_name = strdup(name);
+	ai->owns_shared_memory = owner;
+	return true;
+}
+#endif
+
+// Trees which are not views of the same shared tree
+static int
+mnk_ai_num_distinct_trees(const mnk_ai_t* ai) {
+#ifdef MONTE_ENABLE_SHARED
+	if (ai->shared_memory != NULL) { return 1; }
+#endif
+	return ai->num_threads;
+}
+
+static void
+mnk_ai_write_trace(void* userdata, const void* data, size_t size) {
+	fwrite(data, 1, size, userdata);
+}
+
 mnk_ai_t*
 mnk_ai_create(const mnk_ai_config_t* config) {
+#ifndef MONTE_ENABLE_SHARED
+	if (config->shared_name != NULL) { return NULL; }
+#endif
+
 	monte_config_t monte_config = {
 		.exploration_param = sqrtf(2.0f),
 		.game_config = config->game_config,
 		.num_players = 2,
-		.state_size = sizeof(mnk_state_t) + config->game_config.width * config->game_config.height,
-		.state_alignment = _Alignof(mnk_state_t),
+		.max_rollout_depth = config->max_rollout_depth,
+		.widening_coefficient = config->widening_coefficient,
+		.widening_exponent = config->widening_exponent,
+		.halving_num_candidates = MNK_AI_HALVING_NUM_CANDIDATES,
+		.halving_gumbel_scale = config->gumbel ? 1.f : 0.f,
 	};
+	int num_threads = config->num_threads > 0
+		? config->num_threads
+		: MNK_AI_DEFAULT_NUM_THREADS;
+	int area = config->game_config.width * config->game_config.height;
+
 	mnk_ai_t* ai = malloc(sizeof(mnk_ai_t));
-	for (int i = 0; i < NUM_MONTE_THREADS; ++i) {
+	*ai = (mnk_ai_t){
+		.num_threads = num_threads,
+		.num_iterations = config->num_iterations > 0
+			? config->num_iterations
+			: MNK_AI_DEFAULT_NUM_ITERATIONS,
+		.batch_rollouts = config->batch_rollouts,
+		.pin_threads = config->pin_threads,
+		.sequential_halving = config->sequential_halving,
+		.compact_trees = config->compact_trees && config->scheduler == NULL,
+		.trees = malloc(sizeof(mnk_ai_tree_t) * num_threads),
+		.scheduler = config->scheduler,
+		.move_time_ns = (uint64_t)config->move_time_ms * 1000000u,
+		.snapshot_children = malloc(sizeof(monte_snapshot_child_t) * area),
+		.snapshot_pv = malloc(sizeof(mnk_move_t) * area),
+		.snapshot_num_visits = malloc(sizeof(int) * area),
+		.snapshot_values = malloc(sizeof(float) * area),
+	};
+#ifdef MONTE_ENABLE_SHARED
+	if (config->shared_name != NULL) {
+		size_t shared_size = config->shared_size > 0
+			? config->shared_size
+			: MNK_AI_DEFAULT_SHARED_SIZE;
+		if (!mnk_ai_map_shared_memory(ai, config->shared_name, shared_size)) {
+			free(ai->snapshot_values);
+			free(ai->snapshot_num_visits);
+			free(ai->snapshot_pv);
+			free(ai->snapshot_children);
+			free(ai->trees);
+			free(ai);
+			return NULL;
+		}
+		monte_config.virtual_loss = MNK_AI_VIRTUAL_LOSS;
+		ai->compact_trees = false;
+	}
+#endif
+	mtx_init(&ai->mutex, mtx_plain);
+	cnd_init(&ai->start_cond);
+	cnd_init(&ai->done_cond);
+
+	for (int i = 0; i < num_threads; ++i) {
+		monte_arena_t* arena = monte_arena_create(config->arena_region_size);
 		rnd_pcg_seed(&monte_config.rng_state, i);
-		ai->monte[i] = monte_create(config->initial_state, monte_config);
+		monte_config.allocator_ctx = arena;
+		mnk_ai_tree_t* tree = &ai->trees[i];
+#ifdef MONTE_ENABLE_SHARED
+		if (ai->shared_memory != NULL) {
+			// Searchers in other processes must not follow the same paths
+			rnd_pcg_seed(&monte_config.rng_state, (RND_U32)getpid() * num_threads + i);
+			bool initialize = ai->owns_shared_memory && i == 0;
+			while ((tree->monte = monte_create_shared(
+				config->initial_state, monte_config,
+				ai->shared_memory, ai->shared_size,
+				initialize
+			)) == NULL) {
+				// The owner has not set up the tree yet
+				thrd_sleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+			}
+		} else
+#endif
+		{
+			tree->monte = monte_create(config->initial_state, monte_config);
+		}
+		tree->arena = arena;
+		atomic_flag_clear(&tree->busy);
+		atomic_init(&tree->num_chunks_left, 0);
+		tree->num_step_iterations = 0;
+		tree->job = (monte_job_t){
+			.monte = tree->monte,
+			.batch = config->batch_rollouts,
+			.done = mnk_ai_job_done,
+			.userdata = ai,
+		};
+		tree->last_snapshot = (monte_snapshot_t){ 0 };
+		if (ai->compact_trees) {
+			tree->last_snapshot = (monte_snapshot_t){
+				.children = monte_arena_alloc(
+					arena,
+					sizeof(monte_snapshot_child_t) * area,
+					_Alignof(monte_snapshot_child_t)
+				),
+				.max_children = area,
+				.pv = monte_arena_alloc(
+					arena, sizeof(mnk_move_t) * area, _Alignof(mnk_move_t)
+				),
+				.max_pv_length = area,
+			};
+		}
+		atomic_init(&tree->compacting, false);
 	}
+
+	bool trace = config->trace_path != NULL;
+#ifdef MONTE_ENABLE_SHARED
+	trace = trace && ai->shared_memory == NULL;
+#endif
+	if (trace) {
+		ai->trace_file = fopen(config->trace_path, "wb");
+		if (ai->trace_file != NULL) {
+			monte_trace(ai->trees[0].monte, mnk_ai_write_trace, ai->trace_file);
+		}
+	}
+
+	if (ai->scheduler != NULL) { return ai; }
+
+	ai->workers = malloc(sizeof(mnk_ai_worker_t) * num_threads);
+	for (int i = 0; i < num_threads; ++i) {
+		mnk_ai_worker_t* worker = &ai->workers[i];
+		worker->ai = ai;
+		worker->index = i;
+		thrd_create(&worker->thread, mnk_ai_worker_main, worker);
+	}
+
 	return ai;
 }
 
+size_t
+mnk_ai_memory_usage(const mnk_ai_t* ai) {
+	size_t size = 0;
+	for (int i = 0; i < ai->num_threads; ++i) {
+		size += monte_arena_size(ai->trees[i].arena);
+	}
+#ifdef MONTE_ENABLE_SHARED
+	size += ai->shared_size;
+#endif
+	return size;
+}
+
 void
 mnk_ai_destroy(mnk_ai_t* ai) {
+	mtx_lock(&ai->mutex);
+	ai->shutdown = true;
+	cnd_broadcast(&ai->start_cond);
+	mtx_unlock(&ai->mutex);
+
+	if (ai->scheduler == NULL) {
+		for (int i = 0; i < ai->num_threads; ++i) {
+			thrd_join(ai->workers[i].thread, NULL);
+		}
+	}
+	if (ai->trace_file != NULL) {
+		monte_trace(ai->trees[0].monte, NULL, NULL);
+		fclose(ai->trace_file);
+	}
+	for (int i = 0; i < ai->num_threads; ++i) {
+		// The states are allocated outside of the arena
+		monte_t* monte = ai->trees[i].monte;
+		mnk_state_destroy(monte->current_state);
+		mnk_state_destroy(monte->tmp_state);
+		mnk_state_destroy(monte->tmp_state2);
+		for (int lane = 0; lane < MONTE_BATCH_SIZE; ++lane) {
+			mnk_state_destroy(monte->batch_states[lane]);
+		}
+		monte_arena_destroy(ai->trees[i].arena);
+	}
+#ifdef MONTE_ENABLE_SHARED
+	if (ai->shared_memory != NULL) {
+		munmap(ai->shared_memory, ai->shared_size);
+		if (ai->owns_shared_memory) { shm_unlink(ai->shared_name); }
+		free(ai->shared_name);
+	}
+#endif
+
+	cnd_destroy(&ai->done_cond);
+	cnd_destroy(&ai->start_cond);
+	mtx_destroy(&ai->mutex);
+	free(ai->snapshot_values);
+	free(ai->snapshot_num_visits);
+	free(ai->snapshot_pv);
+	free(ai->snapshot_children);
+	free(ai->workers);
+	free(ai->trees);
 	free(ai);
 }
 
-static int
-mnk_ai_iterate(void* userdata) {
-	monte_t* monte = userdata;
-	for (int i = 0; i < 120000; ++i) {
-		monte_iterate(monte);
+static void
+mnk_ai_wait_for_compaction(mnk_ai_t* ai) {
+	mtx_lock(&ai->mutex);
+	while (ai->num_compacting > 0) {
+		cnd_wait(&ai->done_cond, &ai->mutex);
+	}
+	mtx_unlock(&ai->mutex);
+}
+
+static void
+mnk_ai_search(mnk_ai_t* ai) {
+	int num_chunks = (ai->num_iterations + MNK_AI_CHUNK_SIZE - 1) / MNK_AI_CHUNK_SIZE;
+	for (int i = 0; i < ai->num_threads; ++i) {
+		atomic_store_explicit(&ai->trees[i].num_chunks_left, num_chunks, memory_order_relaxed);
+	}
+
+	mtx_lock(&ai->mutex);
+	ai->num_running = ai->num_threads;
+	ai->compact = false;
+	++ai->generation;
+	cnd_broadcast(&ai->start_cond);
+	while (ai->num_running > 0) {
+		cnd_wait(&ai->done_cond, &ai->mutex);
+	}
+	mtx_unlock(&ai->mutex);
+}
+
+static void
+mnk_ai_search_on_scheduler(mnk_ai_t* ai) {
+	mtx_lock(&ai->mutex);
+	ai->num_running = ai->num_threads;
+	mtx_unlock(&ai->mutex);
+
+	for (int i = 0; i < ai->num_threads; ++i) {
+		monte_job_t* job = &ai->trees[i].job;
+		job->num_iterations = ai->num_iterations;
+		job->time_budget_ns = ai->move_time_ns;
+		monte_scheduler_submit(ai->scheduler->scheduler, job);
 	}
-	return 0;
+
+	mtx_lock(&ai->mutex);
+	while (ai->num_running > 0) {
+		cnd_wait(&ai->done_cond, &ai->mutex);
+	}
+	mtx_unlock(&ai->mutex);
 }
 
 mnk_move_t
 mnk_ai_pick_move(mnk_ai_t* ai) {
-	thrd_t threads[NUM_MONTE_THREADS];
-	for (int i = 0; i < NUM_MONTE_THREADS; ++i) {
-		thrd_create(&threads[i], mnk_ai_iterate, ai->monte[i]);
+	mnk_ai_wait_for_compaction(ai);
+	if (ai->sequential_halving) {
+		for (int i = 0; i < ai->num_threads; ++i) {
+			monte_start_halving(ai->trees[i].monte, ai->num_iterations);
+		}
+	}
+
+	if (ai->scheduler != NULL) {
+		mnk_ai_search_on_scheduler(ai);
+	} else {
+		mnk_ai_search(ai);
 	}
-	for (int i = 0; i < NUM_MONTE_THREADS; ++i) {
-		thrd_join(threads[i], NULL);
+
+	return mnk_ai_best_move(ai);
+}
+
+bool
+mnk_ai_step(mnk_ai_t* ai, uint64_t max_ns) {
+	mnk_ai_wait_for_compaction(ai);
+	// Take turns between the trees which have iterations left
+	for (int i = 0; i < ai->num_threads; ++i) {
+		mnk_ai_tree_t* tree = &ai->trees[ai->next_step_tree];
+		ai->next_step_tree = (ai->next_step_tree + 1) % ai->num_threads;
+		int num_left = ai->num_iterations - tree->num_step_iterations;
+		if (num_left <= 0) { continue; }
+
+		if (tree->num_step_iterations == 0 && ai->sequential_halving) {
+			monte_start_halving(tree->monte, ai->num_iterations);
+		}
+		tree->num_step_iterations += ai->batch_rollouts
+			? monte_step_batch(tree->monte, max_ns, num_left)
+			: monte_step(tree->monte, max_ns, num_left);
+		break;
 	}
+
+	for (int i = 0; i < ai->num_threads; ++i) {
+		if (ai->trees[i].num_step_iterations < ai->num_iterations) { return false; }
+	}
+
+	return true;
+}
+
+mnk_move_t
+mnk_ai_best_move(mnk_ai_t* ai) {
+	mnk_ai_wait_for_compaction(ai);
 	monte_index_t best_score = -1;
 	mnk_move_t best_move = { 0 };
-	for (int i = 0; i < NUM_MONTE_THREADS; ++i) {
-		mnk_move_t move;
+	for (int i = 0; i < ai->num_threads; ++i) {
+		mnk_move_t move = { 0 };
 		float score;
-		monte_pick_move(ai->monte[i], &move, &score);
+		monte_pick_move(ai->trees[i].monte, &move, &score);
 		if (score > best_score) {
 			best_move = move;
 			best_score = score;
 		}
 	}
 
-	return best_move;
+	const mnk_config_t* config = &ai->trees[0].monte->current_state->config;
+	return mnk_transform(config, mnk_invert_symmetry(ai->symmetry), best_move.x, best_move.y);
+}
+
+void
+mnk_ai_snapshot(const mnk_ai_t* ai, mnk_ai_snapshot_t* snapshot) {
+	const mnk_config_t* config = &ai->trees[0].monte->current_state->config;
+	int area = config->width * config->height;
+	int inverse = mnk_invert_symmetry(ai->symmetry);
+
+	monte_snapshot_t live_snapshot = {
+		.children = ai->snapshot_children,
+		.max_children = area,
+		.pv = ai->snapshot_pv,
+		.max_pv_length = snapshot->max_pv_length < area ? snapshot->max_pv_length : area,
+	};
+	// Indexed by cell
+	int* num_visits = ai->snapshot_num_visits;
+	float* values = ai->snapshot_values;
+	memset(num_visits, 0, sizeof(int) * area);
+	memset(values, 0, sizeof(float) * area);
+
+	snapshot->num_visits = 0;
+	snapshot->pv_length = 0;
+	int best_num_visits = -1;
+	for (int i = 0; i < mnk_ai_num_distinct_trees(ai); ++i) {
+		const mnk_ai_tree_t* tree = &ai->trees[i];
+		const monte_snapshot_t* tree_snapshot = &live_snapshot;
+		if (atomic_load_explicit(&tree->compacting, memory_order_acquire)) {
+			// Nothing searches the tree while it is moved, so its last
+			// snapshot is still current
+			tree_snapshot = &tree->last_snapshot;
+		} else {
+			monte_snapshot(tree->monte, &live_snapshot);
+		}
+
+		if (tree_snapshot->num_visits > best_num_visits) {
+			int pv_length = tree_snapshot->pv_length < snapshot->max_pv_length
+				? tree_snapshot->pv_length
+				: snapshot->max_pv_length;
+			for (int j = 0; j < pv_length; ++j) {
+				const mnk_move_t* move = &tree_snapshot->pv[j];
+				snapshot->pv[j] = mnk_transform(config, inverse, move->x, move->y);
+			}
+			snapshot->pv_length = pv_length;
+			best_num_visits = tree_snapshot->num_visits;
+		}
+
+		snapshot->num_visits += tree_snapshot->num_visits;
+		for (monte_index_t j = 0; j < tree_snapshot->num_children; ++j) {
+			const monte_snapshot_child_t* child = &tree_snapshot->children[j];
+			mnk_move_t move = mnk_transform(config, inverse, child->move.x, child->move.y);
+			int cell = move.y * config->width + move.x;
+			num_visits[cell] += child->num_visits;
+			values[cell] += child->win_rate * (float)child->num_visits;
+		}
+	}
+
+	snapshot->num_moves = 0;
+	for (int cell = 0; cell < area && snapshot->num_moves < snapshot->max_moves; ++cell) {
+		if (num_visits[cell] == 0) { continue; }
+
+		snapshot->moves[snapshot->num_moves++] = (mnk_ai_move_stats_t){
+			.move = { .x = cell % config->width, .y = cell / config->width },
+			.num_visits = num_visits[cell],
+			.win_rate = values[cell] / (float)num_visits[cell],
+		};
+	}
 }
 
 void
 mnk_ai_apply(mnk_ai_t* ai, mnk_move_t move) {
-	for (int i = 0; i < NUM_MONTE_THREADS; ++i) {
-		monte_apply_move(ai->monte[i], &move);
+	mnk_ai_wait_for_compaction(ai);
+	const mnk_state_t* state = ai->trees[0].monte->current_state;
+	move = mnk_transform(&state->config, ai->symmetry, move.x, move.y);
+	// The trees play the same canonical image
+	ai->symmetry = mnk_compose_symmetries(ai->symmetry, mnk_canonical_symmetry(state, &move));
+
+	ai->next_step_tree = 0;
+	for (int i = 0; i < ai->num_threads; ++i) {
+		ai->trees[i].num_step_iterations = 0;
+		monte_apply_move(ai->trees[i].monte, &move);
+	}
+
+	if (ai->compact_trees) {
+		for (int i = 0; i < ai->num_threads; ++i) {
+			mnk_ai_tree_t* tree = &ai->trees[i];
+			monte_snapshot(tree->monte, &tree->last_snapshot);
+			atomic_store_explicit(&tree->compacting, true, memory_order_release);
+		}
+
+		// Done by the idle workers, before the next use of the trees
+		mtx_lock(&ai->mutex);
+		ai->compact = true;
+		ai->num_compacting = ai->num_threads;
+		++ai->generation;
+		cnd_broadcast(&ai->start_cond);
+		mtx_unlock(&ai->mutex);
 	}
 }
@@ -1,18 +1,32 @@
 #ifndef MONTE_MNK_H
 #define MONTE_MNK_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct mnk_state_s mnk_state_t;
 typedef struct mnk_config_s mnk_config_t;
 typedef struct mnk_move_s mnk_move_t;
 typedef struct mnk_ai_config_s mnk_ai_config_t;
 typedef struct mnk_ai_s mnk_ai_t;
+typedef struct mnk_scheduler_s mnk_scheduler_t;
+typedef struct mnk_ai_move_stats_s mnk_ai_move_stats_t;
+
+// Every cell counts the stones within candidate_distance of it in an int8_t,
+// and (2 * 5 + 1)^2 - 1 of them fit
+#define MNK_MAX_CANDIDATE_DISTANCE 5
+typedef struct mnk_ai_snapshot_s mnk_ai_snapshot_t;
 
 struct mnk_config_s {
 	int8_t width;
 	int8_t height;
 	int8_t stride;
+
+	// Only consider cells within this (Chebyshev) distance of a stone as
+	// moves. 0 considers every empty cell. Clamped to
+	// MNK_MAX_CANDIDATE_DISTANCE.
+	int8_t candidate_distance;
 };
 
 struct mnk_state_s {
@@ -21,6 +35,19 @@ struct mnk_state_s {
 	int8_t player;
 	int8_t winner;
 	int16_t num_spaces;
+	int16_t num_threats[2];
+	int16_t num_candidates;
+	uint8_t symmetries;
+	// Symmetry masks overwritten by stones, so that undo can restore them
+	uint8_t num_symmetry_changes;
+	struct {
+		int16_t num_spaces;
+		uint8_t symmetries;
+	} symmetry_changes[7];
+	// Rules specialized for this board size, chosen by mnk_state_create
+	uint8_t kernel;
+
+	// width * height cells followed by as many near-stone counts
 	int8_t board[];
 };
 
@@ -32,6 +59,78 @@ struct mnk_move_s {
 struct mnk_ai_config_s {
 	mnk_config_t game_config;
 	mnk_state_t* initial_state;
+
+	// Worker threads, each searching its own tree. 0 for the default.
+	int num_threads;
+	// Iterations per tree for each move. 0 for the default.
+	int num_iterations;
+	// Pin each worker to its own CPU
+	bool pin_threads;
+
+	// Run the trees as jobs on a shared scheduler instead of starting
+	// num_threads workers. num_threads is still the number of trees.
+	mnk_scheduler_t* scheduler;
+	// With a scheduler, stop searching after this long. 0 for no limit.
+	int move_time_ms;
+
+	// Search a single tree in the POSIX shared memory object of that name,
+	// together with every other process using the same name. The first one
+	// creates it with shared_size bytes (0 for the default) and removes it
+	// when destroyed. Needs mnk.c built with MNK_ENABLE_SHARED.
+	const char* shared_name;
+	size_t shared_size;
+
+	// Play out several leaves at once with the lockstep rollout kernel. The
+	// playouts are the same as without it, including max_rollout_depth and
+	// candidate_distance.
+	bool batch_rollouts;
+
+	// Cut playouts short after this many moves and score them with a static
+	// evaluation. 0 plays every game to the end.
+	int16_t max_rollout_depth;
+
+	// Progressive widening, see monte_config_t. 0 disables it.
+	float widening_coefficient;
+	float widening_exponent;
+
+	// Split the iterations of each move over the most promising root moves
+	// with sequential halving instead of UCT, which finds good moves with
+	// fewer iterations. gumbel also samples and ranks them with Gumbel noise.
+	bool sequential_halving;
+	bool gumbel;
+
+	// Size of the memory regions each search tree is allocated from,
+	// 0 for the default
+	size_t arena_region_size;
+	// After each mnk_ai_apply, have the workers copy the remaining trees
+	// into contiguous memory in the background. Ignored with a scheduler or
+	// a shared tree.
+	bool compact_trees;
+
+	// Log the search of the first tree to this file, to be replayed with
+	// replay.c. Ignored with a shared tree.
+	const char* trace_path;
+};
+
+struct mnk_ai_move_stats_s {
+	mnk_move_t move;
+	int num_visits;
+	// Average outcome for the player to move, from -1 to 1
+	float win_rate;
+};
+
+struct mnk_ai_snapshot_s {
+	// Provided by the caller
+	mnk_ai_move_stats_t* moves;
+	int max_moves;
+	mnk_move_t* pv;
+	int max_pv_length;
+
+	// Root moves are summed over all trees, the principal variation comes
+	// from the tree with the most visits
+	int num_visits;
+	int num_moves;
+	int pv_length;
 };
 
 mnk_state_t*
@@ -43,15 +142,46 @@ mnk_state_destroy(mnk_state_t* state);
 void
 mnk_state_apply(mnk_state_t* state, mnk_move_t move);
 
+// Workers shared by every mnk_ai_t created with it. 0 threads for one per CPU.
+mnk_scheduler_t*
+mnk_scheduler_create(int num_threads);
+
+// Every mnk_ai_t using the scheduler must be destroyed first
+void
+mnk_scheduler_destroy(mnk_scheduler_t* scheduler);
+
 mnk_ai_t*
 mnk_ai_create(const mnk_ai_config_t* config);
 
 void
 mnk_ai_destroy(mnk_ai_t* ai);
 
+// Memory reserved for the search trees
+size_t
+mnk_ai_memory_usage(const mnk_ai_t* ai);
+
 mnk_move_t
 mnk_ai_pick_move(mnk_ai_t* ai);
 
+// Search on the calling thread for about max_ns nanoseconds, for callers
+// which cannot block, such as event loops. Each call searches the next tree
+// in turn, the workers are not used. Return true once every tree has done
+// num_iterations iterations for the current move. Calls can be spread out
+// over time and the search can be dropped at any point.
+bool
+mnk_ai_step(mnk_ai_t* ai, uint64_t max_ns);
+
+// Best move found so far by mnk_ai_step or mnk_ai_pick_move
+mnk_move_t
+mnk_ai_best_move(mnk_ai_t* ai);
+
+// Progress of the current search, without locks or allocations. Safe to call
+// from another thread while mnk_ai_pick_move is running or the trees are
+// compacted after mnk_ai_apply, but not concurrently with mnk_ai_apply or
+// with itself.
+void
+mnk_ai_snapshot(const mnk_ai_t* ai, mnk_ai_snapshot_t* snapshot);
+
 void
 mnk_ai_apply(mnk_ai_t* ai, mnk_move_t move);
 
@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include "mnk_sparse.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define MONTE_ARENA_IMPLEMENTATION
+#define MONTE_ARENA_API static
+#include "monte_arena.h"
+
+#define MONTE_GAME_CONFIG_TYPE mnk_sparse_config_t
+#define MONTE_STATE_TYPE mnk_sparse_state_t
+#define MONTE_MOVE_TYPE mnk_sparse_move_t
+#define MONTE_RNG_STATE_TYPE uint64_t
+#define MONTE_ALLOCATOR_CTX_TYPE monte_arena_t
+#define MONTE_MOVE_CURSOR_TYPE int32_t
+#define MONTE_ENABLE_ROLLOUT_POLICY
+#define MONTE_ENABLE_EVALUATION
+// Undo only drops the cells reached by the last stone, while a copy has to
+// rebuild all of them
+#define MONTE_ENABLE_UNDO
+#define MONTE_ENABLE_APPLY_AND_INSPECT
+#define MONTE_IMPLEMENTATION
+#define MONTE_API static
+#define MONTE_USER_FN static
+#include "monte.h"
+
+#define MNK_SPARSE_DEFAULT_CANDIDATE_DISTANCE 2
+#define MNK_SPARSE_INITIAL_CAPACITY 64
+#define MNK_SPARSE_AI_DEFAULT_NUM_ITERATIONS 20000
+#define MNK_SPARSE_AI_DEFAULT_ROLLOUT_DEPTH 32
+
+// Horizontal, vertical, diagonal and anti-diagonal lines
+#define MNK_SPARSE_NUM_AXES 4
+
+#define MNK_SPARSE_THREAT(player, axis) (1 << ((player) * MNK_SPARSE_NUM_AXES + (axis)))
+#define MNK_SPARSE_THREATS(player) (((1 << MNK_SPARSE_NUM_AXES) - 1) << ((player) * MNK_SPARSE_NUM_AXES))
+
+static const int32_t mnk_sparse_axes[MNK_SPARSE_NUM_AXES][2] = {
+	{ 1, 0 }, { 0, 1 }, { 1, 1 }, { 1, -1 },
+};
+
+struct mnk_sparse_cell_s {
+	int32_t x;
+	int32_t y;
+	// Slot of the cell in mnk_sparse_state_t.slots
+	uint32_t slot;
+	// Index in mnk_sparse_state_t.candidates while the cell is empty
+	int32_t candidate;
+	// Player + 1, 0 when empty
+	int8_t stone;
+	// Bits per player and axis along which playing here wins
+	uint8_t threats;
+	// Stones of the same player before and after this one along each axis.
+	// Only kept up to date at both ends of a run and for the last stone.
+	int32_t run_back[MNK_SPARSE_NUM_AXES];
+	int32_t run_ahead[MNK_SPARSE_NUM_AXES];
+};
+
+struct mnk_sparse_stone_s {
+	int32_t cell;
+	// Cells reached before the stone, undo drops the rest
+	int32_t num_cells;
+};
+
+struct mnk_sparse_ai_s {
+	monte_t* monte;
+	monte_arena_t* arena;
+	int num_iterations;
+};
+
+static void*
+monte_user_alloc(size_t size, size_t alignment, monte_allocator_ctx_t* ctx) {
+	return monte_arena_alloc(ctx, size, alignment);
+}
+
+// splitmix64
+static inline uint64_t
+mnk_sparse_rng_next(uint64_t* state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static float
+monte_user_rng_next(monte_rng_state_t* rng_state) {
+	return (float)(mnk_sparse_rng_next(rng_state) >> 40) * 0x1p-24f;
+}
+
+static inline int32_t
+mnk_sparse_rng_range(uint64_t* state, int32_t size) {
+	return (int32_t)(((mnk_sparse_rng_next(state) >> 32) * (uint64_t)size) >> 32);
+}
+
+static inline uint32_t
+mnk_sparse_hash(int32_t x, int32_t y) {
+	uint64_t key = ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static inline uint32_t
+mnk_sparse_slot_mask(const mnk_sparse_state_t* state) {
+	return (uint32_t)state->capacity * 2 - 1;
+}
+
+static inline bool
+mnk_sparse_slot_is_used(const mnk_sparse_state_t* state, uint32_t slot) {
+	uint32_t index = state->slots[slot];
+	return index < (uint32_t)state->num_cells && state->cells[index].slot == slot;
+}
+
+static inline bool
+mnk_sparse_in_bounds(const mnk_sparse_config_t* config, int32_t x, int32_t y) {
+	return (config->width == 0 || (0 <= x && x < config->width))
+		&& (config->height == 0 || (0 <= y && y < config->height));
+}
+
+static inline mnk_sparse_move_t
+mnk_sparse_center(const mnk_sparse_config_t* config) {
+	return (mnk_sparse_move_t){
+		.x = config->width / 2,
+		.y = config->height / 2,
+	};
+}
+
+// Index of the cell at (x, y), -1 if it is not within candidate_distance of
+// a stone
+static inline int32_t
+mnk_sparse_find(const mnk_sparse_state_t* state, int32_t x, int32_t y) {
+	uint32_t mask = mnk_sparse_slot_mask(state);
+	for (uint32_t slot = mnk_sparse_hash(x, y) & mask;; slot = (slot + 1) & mask) {
+		if (!mnk_sparse_slot_is_used(state, slot)) { return -1; }
+
+		int32_t index = (int32_t)state->slots[slot];
+		const mnk_sparse_cell_t* cell = &state->cells[index];
+		if (cell->x == x && cell->y == y) { return index; }
+	}
+}
+
+static inline int8_t
+mnk_sparse_get(const mnk_sparse_state_t* state, int32_t x, int32_t y) {
+	int32_t index = mnk_sparse_find(state, x, y);
+	return index >= 0 ? state->cells[index].stone - 1 : -1;
+}
+
+static inline bool
+mnk_sparse_is_empty(const mnk_sparse_state_t* state, int32_t x, int32_t y) {
+	return mnk_sparse_in_bounds(&state->config, x, y)
+		&& mnk_sparse_get(state, x, y) == MONTE_INVALID_PLAYER;
+}
+
+// The cell must not exist yet and there must be room for it
+static inline int32_t
+mnk_sparse_insert(mnk_sparse_state_t* state, int32_t x, int32_t y) {
+	uint32_t mask = mnk_sparse_slot_mask(state);
+	uint32_t slot = mnk_sparse_hash(x, y) & mask;
+	while (mnk_sparse_slot_is_used(state, slot)) {
+		slot = (slot + 1) & mask;
+	}
+
+	int32_t index = state->num_cells++;
+	state->slots[slot] = (uint32_t)index;
+	state->cells[index] = (mnk_sparse_cell_t){
+		.x = x,
+		.y = y,
+		.slot = slot,
+		.candidate = -1,
+	};
+	return index;
+}
+
+// Leaves the slots free, to be filled by the caller
+static void
+mnk_sparse_resize(mnk_sparse_state_t* state, int32_t capacity) {
+	state->capacity = capacity;
+	state->cells = realloc(state->cells, sizeof(mnk_sparse_cell_t) * capacity);
+	state->candidates = realloc(state->candidates, sizeof(int32_t) * capacity);
+	state->stones = realloc(state->stones, sizeof(mnk_sparse_stone_t) * capacity);
+	free(state->slots);
+	state->slots = malloc(sizeof(uint32_t) * capacity * 2);
+	memset(state->slots, 0xff, sizeof(uint32_t) * capacity * 2);
+}
+
+static void
+mnk_sparse_rehash(mnk_sparse_state_t* state) {
+	uint32_t mask = mnk_sparse_slot_mask(state);
+	for (int32_t i = 0; i < state->num_cells; ++i) {
+		mnk_sparse_cell_t* cell = &state->cells[i];
+		uint32_t slot = mnk_sparse_hash(cell->x, cell->y) & mask;
+		while (state->slots[slot] != UINT32_MAX) {
+			slot = (slot + 1) & mask;
+		}
+		state->slots[slot] = (uint32_t)i;
+		cell->slot = slot;
+	}
+}
+
+static void
+mnk_sparse_reserve(mnk_sparse_state_t* state, int32_t num_cells) {
+	if (num_cells <= state->capacity) { return; }
+
+	int32_t capacity = state->capacity;
+	while (capacity < num_cells) { capacity *= 2; }
+	mnk_sparse_resize(state, capacity);
+	mnk_sparse_rehash(state);
+}
+
+static mnk_sparse_state_t*
+monte_user_create_state(const mnk_sparse_config_t* config) {
+	return mnk_sparse_state_create(config);
+}
+
+static void
+monte_user_copy_state(mnk_sparse_state_t* dst, const mnk_sparse_state_t* src) {
+	// Capacities only grow, so that states copied back and forth settle on
+	// the same one and the slots can be copied as they are
+	bool same_capacity = dst->capacity == src->capacity;
+	if (dst->capacity < src->capacity) {
+		mnk_sparse_resize(dst, src->capacity);
+	} else if (!same_capacity) {
+		memset(dst->slots, 0xff, sizeof(uint32_t) * dst->capacity * 2);
+	}
+
+	mnk_sparse_state_t arrays = *dst;
+	*dst = *src;
+	dst->capacity = arrays.capacity;
+	dst->cells = arrays.cells;
+	dst->slots = arrays.slots;
+	dst->candidates = arrays.candidates;
+	dst->stones = arrays.stones;
+
+	memcpy(dst->cells, src->cells, sizeof(mnk_sparse_cell_t) * src->num_cells);
+	memcpy(dst->candidates, src->candidates, sizeof(int32_t) * src->num_candidates);
+	memcpy(dst->stones, src->stones, sizeof(mnk_sparse_stone_t) * src->num_stones);
+	if (same_capacity) {
+		memcpy(dst->slots, src->slots, sizeof(uint32_t) * src->capacity * 2);
+	} else {
+		mnk_sparse_rehash(dst);
+	}
+}
+
+static inline void
+mnk_sparse_add_candidate(mnk_sparse_state_t* state, int32_t index) {
+	state->cells[index].candidate = state->num_candidates;
+	state->candidates[state->num_candidates++] = index;
+}
+
+static inline void
+mnk_sparse_remove_candidate(mnk_sparse_state_t* state, int32_t index) {
+	int32_t position = state->cells[index].candidate;
+	int32_t last = state->candidates[--state->num_candidates];
+	state->candidates[position] = last;
+	state->cells[last].candidate = position;
+}
+
+// Undo mnk_sparse_remove_candidate, once everything added since is gone
+static inline void
+mnk_sparse_restore_candidate(mnk_sparse_state_t* state, int32_t index) {
+	int32_t position = state->cells[index].candidate;
+	if (position < state->num_candidates) {
+		int32_t moved = state->candidates[position];
+		state->cells[moved].candidate = state->num_candidates;
+		state->candidates[state->num_candidates] = moved;
+	}
+	state->candidates[position] = index;
+	++state->num_candidates;
+}
+
+// Stones of `player` in a row starting at (x, y) and going along an axis.
+// (x, y) must be the end of a run facing that way, or the last stone played,
+// or not hold a stone of `player`.
+static inline int32_t
+mnk_sparse_run_from(
+	const mnk_sparse_state_t* state,
+	monte_player_id_t player,
+	int32_t x, int32_t y,
+	int axis, int32_t sign
+) {
+	int32_t index = mnk_sparse_find(state, x, y);
+	if (index < 0) { return 0; }
+
+	const mnk_sparse_cell_t* cell = &state->cells[index];
+	if (cell->stone != player + 1) { return 0; }
+
+	return 1 + (sign > 0 ? cell->run_ahead[axis] : cell->run_back[axis]);
+}
+
+static inline void
+mnk_sparse_set_threat(
+	mnk_sparse_state_t* state,
+	int32_t index,
+	monte_player_id_t player,
+	int axis,
+	bool is_threat
+) {
+	mnk_sparse_cell_t* cell = &state->cells[index];
+	uint8_t flag = MNK_SPARSE_THREAT(player, axis);
+	uint8_t threats = is_threat ? cell->threats | flag : cell->threats & ~flag;
+	uint8_t mask = MNK_SPARSE_THREATS(player);
+	state->num_threats[player] += ((threats & mask) != 0) - ((cell->threats & mask) != 0);
+	cell->threats = threats;
+}
+
+// Recheck whether playing at (x, y) completes a stride of `player` along
+// `axis`, the other axes are unchanged
+static inline void
+mnk_sparse_update_threat(
+	mnk_sparse_state_t* state,
+	int32_t x, int32_t y,
+	monte_player_id_t player,
+	int axis
+) {
+	int32_t index = mnk_sparse_find(state, x, y);
+	if (index < 0) { return; }
+
+	int32_t dir_x = mnk_sparse_axes[axis][0];
+	int32_t dir_y = mnk_sparse_axes[axis][1];
+	bool is_threat = state->cells[index].stone == 0
+		&& mnk_sparse_run_from(state, player, x - dir_x, y - dir_y, axis, -1)
+			+ mnk_sparse_run_from(state, player, x + dir_x, y + dir_y, axis, 1)
+			+ 1 >= state->config.stride;
+	mnk_sparse_set_threat(state, index, player, axis, is_threat);
+}
+
+static void
+mnk_sparse_update_threats_around(
+	mnk_sparse_state_t* state,
+	int32_t x, int32_t y,
+	monte_player_id_t player
+) {
+	int32_t index = mnk_sparse_find(state, x, y);
+	// Either the stone just played or an empty cell
+	bool is_stone = index >= 0 && state->cells[index].stone != 0;
+	for (int axis = 0; axis < MNK_SPARSE_NUM_AXES; ++axis) {
+		int32_t dir_x = mnk_sparse_axes[axis][0];
+		int32_t dir_y = mnk_sparse_axes[axis][1];
+		if (is_stone) {
+			mnk_sparse_set_threat(state, index, 0, axis, false);
+			mnk_sparse_set_threat(state, index, 1, axis, false);
+		} else {
+			mnk_sparse_update_threat(state, x, y, 0, axis);
+			mnk_sparse_update_threat(state, x, y, 1, axis);
+		}
+
+		// Along each line, only the first cell past the run of `player`
+		// stones through (x, y) can change
+		for (int32_t sign = -1; sign <= 1; sign += 2) {
+			int32_t distance = is_stone
+				? (sign > 0 ? state->cells[index].run_ahead[axis] : state->cells[index].run_back[axis]) + 1
+				: mnk_sparse_run_from(state, player, x + sign * dir_x, y + sign * dir_y, axis, sign) + 1;
+			mnk_sparse_update_threat(state, x + sign * distance * dir_x, y + sign * distance * dir_y, player, axis);
+		}
+	}
+}
+
+// Join the runs on both sides of a new stone, return the longest
+static int32_t
+mnk_sparse_join_runs(mnk_sparse_state_t* state, int32_t index, monte_player_id_t player) {
+	int32_t longest_run = 0;
+	for (int axis = 0; axis < MNK_SPARSE_NUM_AXES; ++axis) {
+		mnk_sparse_cell_t* cell = &state->cells[index];
+		int32_t dir_x = mnk_sparse_axes[axis][0];
+		int32_t dir_y = mnk_sparse_axes[axis][1];
+		int32_t back = mnk_sparse_run_from(state, player, cell->x - dir_x, cell->y - dir_y, axis, -1);
+		int32_t ahead = mnk_sparse_run_from(state, player, cell->x + dir_x, cell->y + dir_y, axis, 1);
+		cell->run_back[axis] = back;
+		cell->run_ahead[axis] = ahead;
+
+		if (back > 0) {
+			int32_t first = mnk_sparse_find(state, cell->x - back * dir_x, cell->y - back * dir_y);
+			state->cells[first].run_ahead[axis] = back + ahead;
+		}
+		if (ahead > 0) {
+			int32_t last = mnk_sparse_find(state, cell->x + ahead * dir_x, cell->y + ahead * dir_y);
+			state->cells[last].run_back[axis] = back + ahead;
+		}
+
+		if (back + ahead + 1 > longest_run) { longest_run = back + ahead + 1; }
+	}
+
+	return longest_run;
+}
+
+// Undo mnk_sparse_join_runs, the stone must be the last one played
+static void
+mnk_sparse_split_runs(mnk_sparse_state_t* state, int32_t index) {
+	const mnk_sparse_cell_t* cell = &state->cells[index];
+	for (int axis = 0; axis < MNK_SPARSE_NUM_AXES; ++axis) {
+		int32_t dir_x = mnk_sparse_axes[axis][0];
+		int32_t dir_y = mnk_sparse_axes[axis][1];
+		int32_t back = cell->run_back[axis];
+		int32_t ahead = cell->run_ahead[axis];
+
+		if (back > 0) {
+			int32_t first = mnk_sparse_find(state, cell->x - back * dir_x, cell->y - back * dir_y);
+			state->cells[first].run_ahead[axis] = back - 1;
+		}
+		if (ahead > 0) {
+			int32_t last = mnk_sparse_find(state, cell->x + ahead * dir_x, cell->y + ahead * dir_y);
+			state->cells[last].run_back[axis] = ahead - 1;
+		}
+	}
+}
+
+static void
+mnk_sparse_set(mnk_sparse_state_t* state, int32_t x, int32_t y, monte_player_id_t player) {
+	int32_t distance = state->config.candidate_distance;
+	int32_t num_cells = state->num_cells;
+	mnk_sparse_reserve(state, num_cells + (2 * distance + 1) * (2 * distance + 1));
+
+	int32_t index = mnk_sparse_find(state, x, y);
+	if (index < 0) {
+		index = mnk_sparse_insert(state, x, y);
+	} else {
+		mnk_sparse_remove_candidate(state, index);
+	}
+	state->stones[state->num_stones++] = (mnk_sparse_stone_t){
+		.cell = index,
+		.num_cells = num_cells,
+	};
+	state->cells[index].stone = player + 1;
+
+	for (int32_t cy = y - distance; cy <= y + distance; ++cy) {
+		for (int32_t cx = x - distance; cx <= x + distance; ++cx) {
+			if (
+				mnk_sparse_in_bounds(&state->config, cx, cy)
+				&& mnk_sparse_find(state, cx, cy) < 0
+			) {
+				mnk_sparse_add_candidate(state, mnk_sparse_insert(state, cx, cy));
+			}
+		}
+	}
+}
+
+static void
+mnk_sparse_apply_move(mnk_sparse_state_t* state, const mnk_sparse_move_t* move) {
+	if (state->player == MONTE_INVALID_PLAYER) { return; }
+
+	monte_player_id_t player = state->player;
+	mnk_sparse_set(state, move->x, move->y, player);
+	int32_t index = state->stones[state->num_stones - 1].cell;
+	int32_t longest_run = mnk_sparse_join_runs(state, index, player);
+	mnk_sparse_update_threats_around(state, move->x, move->y, player);
+
+	if (longest_run >= state->config.stride) {
+		state->player = MONTE_INVALID_PLAYER;
+		state->winner = player;
+	} else if (state->num_candidates == 0) {
+		// Only happens once a bounded board is full
+		state->player = MONTE_INVALID_PLAYER;
+		state->winner = MONTE_INVALID_PLAYER;
+	} else {
+		state->player = 1 - player;
+	}
+}
+
+static void
+monte_user_apply_move(monte_state_t* state, const monte_move_t* move) {
+	mnk_sparse_apply_move(state, move);
+}
+
+static void
+monte_user_undo_move(monte_state_t* state, const monte_move_t* move) {
+	mnk_sparse_stone_t stone = state->stones[--state->num_stones];
+	int32_t index = stone.cell;
+	monte_player_id_t player = state->cells[index].stone - 1;
+	mnk_sparse_split_runs(state, index);
+
+	// Drop the cells which were only reached through this stone
+	for (int32_t i = stone.num_cells; i < state->num_cells; ++i) {
+		uint8_t threats = state->cells[i].threats;
+		state->num_threats[0] -= (threats & MNK_SPARSE_THREATS(0)) != 0;
+		state->num_threats[1] -= (threats & MNK_SPARSE_THREATS(1)) != 0;
+	}
+	state->num_candidates -= state->num_cells - stone.num_cells - (index >= stone.num_cells);
+	state->num_cells = stone.num_cells;
+
+	if (index < state->num_cells) {
+		state->cells[index].stone = 0;
+		mnk_sparse_restore_candidate(state, index);
+	}
+	mnk_sparse_update_threats_around(state, move->x, move->y, player);
+
+	state->player = player;
+	state->winner = MONTE_INVALID_PLAYER;
+}
+
+static inline void
+mnk_sparse_inspect(const mnk_sparse_state_t* state, monte_state_info_t* info) {
+	info->current_player = state->player;
+	if (state->player != MONTE_INVALID_PLAYER) { return; }
+
+	if (state->winner != MONTE_INVALID_PLAYER) {
+		info->scores[state->winner] = 1;
+		info->scores[1 - state->winner] = -1;
+	} else {
+		info->scores[0] = 0;
+		info->scores[1] = 0;
+	}
+}
+
+static void
+monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info) {
+	mnk_sparse_inspect(state, info);
+}
+
+static void
+monte_user_apply_and_inspect(
+	monte_state_t* state,
+	const monte_move_t* move,
+	monte_state_info_t* info
+) {
+	mnk_sparse_apply_move(state, move);
+	mnk_sparse_inspect(state, info);
+}
+
+static inline mnk_sparse_move_t
+mnk_sparse_candidate(const mnk_sparse_state_t* state, int32_t position) {
+	const mnk_sparse_cell_t* cell = &state->cells[state->candidates[position]];
+	return (mnk_sparse_move_t){ .x = cell->x, .y = cell->y };
+}
+
+static bool
+monte_user_next_move(const monte_state_t* state, int32_t* cursor, mnk_sparse_move_t* move) {
+	if (state->num_stones == 0) {
+		// Nothing to be near yet
+		*move = mnk_sparse_center(&state->config);
+		return (*cursor)++ == 0;
+	}
+
+	if (*cursor >= state->num_candidates) { return false; }
+
+	*move = mnk_sparse_candidate(state, (*cursor)++);
+	return true;
+}
+
+static bool
+monte_user_moves_equal(const monte_move_t* lhs, const monte_move_t* rhs) {
+	return (lhs->x == rhs->x) && (lhs->y == rhs->y);
+}
+
+// Static evaluation
+//
+// Same idea as the window count of the dense board, over runs instead of
+// cells: each run is worth more the longer it is and the more of its ends
+// are open. A player to move with a threat wins, and so does an opponent
+// holding two threats.
+static void
+monte_user_evaluate_state(const mnk_sparse_state_t* state, float* values) {
+	monte_player_id_t player = state->player;
+	monte_player_id_t opponent = 1 - player;
+	if (state->num_threats[player] > 0) {
+		values[player] = 1.f;
+		values[opponent] = -1.f;
+		return;
+	}
+
+	if (state->num_threats[opponent] > 1) {
+		values[player] = -1.f;
+		values[opponent] = 1.f;
+		return;
+	}
+
+	float run_scores[2] = { 0.f, 0.f };
+	for (int32_t i = 0; i < state->num_stones; ++i) {
+		const mnk_sparse_cell_t* cell = &state->cells[state->stones[i].cell];
+		monte_player_id_t stone = cell->stone - 1;
+		for (int axis = 0; axis < MNK_SPARSE_NUM_AXES; ++axis) {
+			int32_t dir_x = mnk_sparse_axes[axis][0];
+			int32_t dir_y = mnk_sparse_axes[axis][1];
+			// Count each run once, from its first stone
+			if (mnk_sparse_get(state, cell->x - dir_x, cell->y - dir_y) == stone) { continue; }
+
+			int32_t length = cell->run_ahead[axis] + 1;
+			int32_t num_open_ends = mnk_sparse_is_empty(state, cell->x - dir_x, cell->y - dir_y)
+				+ mnk_sparse_is_empty(state, cell->x + length * dir_x, cell->y + length * dir_y);
+			run_scores[stone] += (float)num_open_ends * ldexpf(1.f, 2 * (length - 1));
+		}
+	}
+
+	float value = (run_scores[0] - run_scores[1]) / (run_scores[0] + run_scores[1] + 1.f);
+	values[0] = value;
+	values[1] = -value;
+}
+
+static bool
+mnk_sparse_find_threat(
+	const mnk_sparse_state_t* state,
+	monte_player_id_t player,
+	mnk_sparse_move_t* move
+) {
+	// Threats are next to a stone, so always candidates
+	for (int32_t i = 0; i < state->num_candidates; ++i) {
+		if (state->cells[state->candidates[i]].threats & MNK_SPARSE_THREATS(player)) {
+			*move = mnk_sparse_candidate(state, i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+monte_user_pick_rollout_move(
+	const mnk_sparse_state_t* state,
+	uint64_t* rng_state,
+	mnk_sparse_move_t* move
+) {
+	monte_player_id_t player = state->player;
+	if (state->num_stones == 0) {
+		*move = mnk_sparse_center(&state->config);
+		return true;
+	}
+
+	// Decisive move: win right away
+	if (state->num_threats[player] > 0) {
+		return mnk_sparse_find_threat(state, player, move);
+	}
+
+	// Anti-decisive move: block the opponent's win
+	if (state->num_threats[1 - player] > 0) {
+		return mnk_sparse_find_threat(state, 1 - player, move);
+	}
+
+	*move = mnk_sparse_candidate(state, mnk_sparse_rng_range(rng_state, state->num_candidates));
+	return true;
+}
+
+mnk_sparse_state_t*
+mnk_sparse_state_create(const mnk_sparse_config_t* config) {
+	mnk_sparse_state_t* state = malloc(sizeof(mnk_sparse_state_t));
+	*state = (mnk_sparse_state_t){
+		.config = *config,
+		.player = 0,
+		.winner = MONTE_INVALID_PLAYER,
+	};
+	if (state->config.candidate_distance <= 0) {
+		state->config.candidate_distance = MNK_SPARSE_DEFAULT_CANDIDATE_DISTANCE;
+	}
+	mnk_sparse_resize(state, MNK_SPARSE_INITIAL_CAPACITY);
+	return state;
+}
+
+void
+mnk_sparse_state_destroy(mnk_sparse_state_t* state) {
+	free(state->cells);
+	free(state->slots);
+	free(state->candidates);
+	free(state->stones);
+	free(state);
+}
+
+void
+mnk_sparse_state_apply(mnk_sparse_state_t* state, mnk_sparse_move_t move) {
+	mnk_sparse_apply_move(state, &move);
+}
+
+int8_t
+mnk_sparse_state_get(const mnk_sparse_state_t* state, int32_t x, int32_t y) {
+	return mnk_sparse_get(state, x, y);
+}
+
+mnk_sparse_ai_t*
+mnk_sparse_ai_create(const mnk_sparse_ai_config_t* config) {
+	monte_arena_t* arena = monte_arena_create(0);
+	// The tree is searched on this thread
+	monte_arena_bind(arena);
+	mnk_sparse_ai_t* ai = malloc(sizeof(mnk_sparse_ai_t));
+	*ai = (mnk_sparse_ai_t){
+		.monte = monte_create(config->initial_state, (monte_config_t){
+			.exploration_param = sqrtf(2.0f),
+			.game_config = config->game_config,
+			.num_players = 2,
+			.max_rollout_depth = config->max_rollout_depth > 0
+				? config->max_rollout_depth
+				: MNK_SPARSE_AI_DEFAULT_ROLLOUT_DEPTH,
+			.allocator_ctx = arena,
+			.rng_state = config->seed,
+		}),
+		.arena = arena,
+		.num_iterations = config->num_iterations > 0
+			? config->num_iterations
+			: MNK_SPARSE_AI_DEFAULT_NUM_ITERATIONS,
+	};
+	return ai;
+}
+
+void
+mnk_sparse_ai_destroy(mnk_sparse_ai_t* ai) {
+	// The states own memory outside of the arena
+	mnk_sparse_state_destroy(ai->monte->current_state);
+	mnk_sparse_state_destroy(ai->monte->tmp_state);
+	mnk_sparse_state_destroy(ai->monte->tmp_state2);
+	monte_arena_destroy(ai->arena);
+	free(ai);
+}
+
+mnk_sparse_move_t
+mnk_sparse_ai_pick_move(mnk_sparse_ai_t* ai) {
+	for (int i = 0; i < ai->num_iterations; ++i) {
+		monte_iterate(ai->monte);
+	}
+
+	mnk_sparse_move_t move;
+	float score;
+	monte_pick_move(ai->monte, &move, &score);
+	return move;
+}
+
+void
+mnk_sparse_ai_apply(mnk_sparse_ai_t* ai, mnk_sparse_move_t move) {
+	monte_apply_move(ai->monte, &move);
+}
+
+size_t
+mnk_sparse_ai_memory_usage(const mnk_sparse_ai_t* ai) {
+	return monte_arena_size(ai->arena);
+}
@@ -0,0 +1,108 @@
+#ifndef MONTE_MNK_SPARSE_H
+#define MONTE_MNK_SPARSE_H
+
+// mnk variant for boards which are too large for the dense one in mnk.h, up
+// to unbounded ones.
+//
+// Only cells next to a stone are stored, in a hash table. Memory, copies and
+// move generation scale with the number of stones played instead of the
+// board area. Moves are restricted to cells within candidate_distance of a
+// stone and the first one is played in the center.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct mnk_sparse_state_s mnk_sparse_state_t;
+typedef struct mnk_sparse_config_s mnk_sparse_config_t;
+typedef struct mnk_sparse_move_s mnk_sparse_move_t;
+typedef struct mnk_sparse_cell_s mnk_sparse_cell_t;
+typedef struct mnk_sparse_stone_s mnk_sparse_stone_t;
+typedef struct mnk_sparse_ai_config_s mnk_sparse_ai_config_t;
+typedef struct mnk_sparse_ai_s mnk_sparse_ai_t;
+
+struct mnk_sparse_config_s {
+	// 0 for an unbounded side, whose coordinates can be negative
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+
+	// Chebyshev distance from a stone within which cells are moves.
+	// 0 for the default of 2.
+	int32_t candidate_distance;
+};
+
+struct mnk_sparse_move_s {
+	int32_t x;
+	int32_t y;
+};
+
+struct mnk_sparse_state_s {
+	mnk_sparse_config_t config;
+
+	int8_t player;
+	int8_t winner;
+	int32_t num_stones;
+	int32_t num_threats[2];
+
+	// Cells within candidate_distance of a stone, in the order they were
+	// reached. Stones are undone in reverse, which only ever drops the last
+	// cells, so a cell keeps its index for as long as it exists.
+	mnk_sparse_cell_t* cells;
+	int32_t num_cells;
+	int32_t capacity;
+	// Open addressing, from coordinates to cell index. A slot is free unless
+	// it points to a cell below num_cells which lives in it, so dropping
+	// cells needs no erasing.
+	uint32_t* slots;
+	// Empty cells among them, which are the moves
+	int32_t* candidates;
+	int32_t num_candidates;
+	// In the order they were played
+	mnk_sparse_stone_t* stones;
+};
+
+struct mnk_sparse_ai_config_s {
+	mnk_sparse_config_t game_config;
+	mnk_sparse_state_t* initial_state;
+
+	// Iterations for each move. 0 for the default.
+	int num_iterations;
+	// Playouts are cut short after this many moves and scored with a static
+	// evaluation, since they rarely end on a large board. 0 for the default.
+	int16_t max_rollout_depth;
+	// Seeds the playouts
+	uint64_t seed;
+};
+
+mnk_sparse_state_t*
+mnk_sparse_state_create(const mnk_sparse_config_t* config);
+
+void
+mnk_sparse_state_destroy(mnk_sparse_state_t* state);
+
+void
+mnk_sparse_state_apply(mnk_sparse_state_t* state, mnk_sparse_move_t move);
+
+// -1 when empty
+int8_t
+mnk_sparse_state_get(const mnk_sparse_state_t* state, int32_t x, int32_t y);
+
+// A single tree searched on the calling thread
+mnk_sparse_ai_t*
+mnk_sparse_ai_create(const mnk_sparse_ai_config_t* config);
+
+void
+mnk_sparse_ai_destroy(mnk_sparse_ai_t* ai);
+
+mnk_sparse_move_t
+mnk_sparse_ai_pick_move(mnk_sparse_ai_t* ai);
+
+void
+mnk_sparse_ai_apply(mnk_sparse_ai_t* ai, mnk_sparse_move_t move);
+
+// Memory reserved for the search tree
+size_t
+mnk_sparse_ai_memory_usage(const mnk_sparse_ai_t* ai);
+
+#endif
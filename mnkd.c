@@ -0,0 +1,617 @@
+#define _GNU_SOURCE
+#include "mnk.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Engine daemon: keeps a search tree per named session across requests and
+// connections, so that trees stay warm and nothing is rebuilt per request.
+//
+// Clients connect to a UNIX stream socket and send one command per line,
+// each answered with one line:
+//
+//   new <session> <width> <height> <stride> [candidate_distance]   ok
+//   apply <session> <x> <y>                                        ok
+//   search <session> <ms>                                          move <x> <y>
+//   snapshot <session> [max_moves]
+//       snapshot <visits> <num_moves> (<x> <y> <visits> <win_rate>)...
+//       pv <length> (<x> <y>)...
+//   close <session>                                                ok
+//   stats                       stats <sessions> <memory> <max_memory>
+//
+// Failures are answered with "error <reason>". A new session replaces one of
+// the same name.
+//
+// Everything runs on a single thread. Searches are run in slices with
+// mnk_ai_step, interleaved with each other and with serving commands. A
+// client waiting on a search has its next commands held until it is done.
+//
+// The memory of all trees is bounded: the least recently used sessions which
+// are not searching are dropped to make room, then running searches are cut
+// short.
+
+#define MNKD_DEFAULT_MAX_MEMORY_MB 1024
+// Trees grow in regions of this size, which is also the smallest session
+#define MNKD_ARENA_REGION_SIZE ((size_t)8 << 20)
+// Time each search runs before the next one gets a turn
+#define MNKD_SLICE_NS 2000000u
+#define MNKD_MAX_LINE_LENGTH 256
+#define MNKD_MAX_NAME_LENGTH 63
+#define MNKD_MAX_PV_LENGTH 16
+#define MNKD_LISTEN_BACKLOG 16
+
+typedef struct mnkd_client_s mnkd_client_t;
+
+typedef struct {
+	char name[MNKD_MAX_NAME_LENGTH + 1];
+	mnk_state_t* state;
+	mnk_ai_t* ai;
+	uint64_t last_used_ns;
+
+	// Client waiting for the result of a search, NULL when idle
+	mnkd_client_t* searcher;
+	uint64_t search_deadline_ns;
+} mnkd_session_t;
+
+struct mnkd_client_s {
+	int fd;
+	char input[MNKD_MAX_LINE_LENGTH];
+	size_t input_size;
+	// Set while a search is running for this client
+	mnkd_session_t* waiting_on;
+	// Set when its search is answered, until the rest of its input is run
+	bool resume_input;
+	bool closed;
+};
+
+typedef struct {
+	size_t max_memory;
+
+	mnkd_session_t** sessions;
+	int num_sessions;
+	int sessions_capacity;
+
+	mnkd_client_t** clients;
+	int num_clients;
+	int clients_capacity;
+} mnkd_t;
+
+static volatile sig_atomic_t mnkd_running = 1;
+
+static void
+mnkd_stop(int signal) {
+	(void)signal;
+	mnkd_running = 0;
+}
+
+static uint64_t
+mnkd_clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+mnkd_reply(mnkd_client_t* client, const char* format, ...) {
+	if (client->closed) { return; }
+
+	char line[4096];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+	if (length < 0) { return; }
+	if ((size_t)length > sizeof(line) - 2) { length = sizeof(line) - 2; }
+	line[length++] = '\n';
+
+	// Replies are small, the socket buffer takes them without blocking
+	// unless the client stops reading
+	for (int offset = 0; offset < length;) {
+		ssize_t num_written = send(client->fd, line + offset, length - offset, MSG_NOSIGNAL);
+		if (num_written < 0) {
+			if (errno == EINTR) { continue; }
+			client->closed = true;
+			return;
+		}
+		offset += num_written;
+	}
+}
+
+static mnkd_session_t*
+mnkd_find_session(mnkd_t* daemon, const char* name) {
+	for (int i = 0; i < daemon->num_sessions; ++i) {
+		if (strcmp(daemon->sessions[i]->name, name) == 0) {
+			return daemon->sessions[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+mnkd_destroy_session(mnkd_t* daemon, mnkd_session_t* session) {
+	for (int i = 0; i < daemon->num_sessions; ++i) {
+		if (daemon->sessions[i] == session) {
+			daemon->sessions[i] = daemon->sessions[--daemon->num_sessions];
+			break;
+		}
+	}
+
+	mnk_ai_destroy(session->ai);
+	mnk_state_destroy(session->state);
+	free(session);
+}
+
+static size_t
+mnkd_memory_usage(const mnkd_t* daemon) {
+	size_t size = 0;
+	for (int i = 0; i < daemon->num_sessions; ++i) {
+		size += mnk_ai_memory_usage(daemon->sessions[i]->ai);
+	}
+	return size;
+}
+
+static void
+mnkd_enforce_memory_limit(mnkd_t* daemon, const mnkd_session_t* keep) {
+	size_t memory_usage = mnkd_memory_usage(daemon);
+	while (memory_usage > daemon->max_memory) {
+		mnkd_session_t* victim = NULL;
+		for (int i = 0; i < daemon->num_sessions; ++i) {
+			mnkd_session_t* session = daemon->sessions[i];
+			if (session == keep || session->searcher != NULL) { continue; }
+			if (victim == NULL || session->last_used_ns < victim->last_used_ns) {
+				victim = session;
+			}
+		}
+		if (victim == NULL) { break; }
+
+		memory_usage -= mnk_ai_memory_usage(victim->ai);
+		mnkd_destroy_session(daemon, victim);
+	}
+
+	if (memory_usage > daemon->max_memory) {
+		// Only searching sessions are left, let them finish with what they have
+		uint64_t now = mnkd_clock_ns();
+		for (int i = 0; i < daemon->num_sessions; ++i) {
+			mnkd_session_t* session = daemon->sessions[i];
+			if (session->searcher != NULL) { session->search_deadline_ns = now; }
+		}
+	}
+}
+
+static void
+mnkd_new(mnkd_t* daemon, mnkd_client_t* client, const char* name, const char* args) {
+	int width, height, stride;
+	int candidate_distance = 0;
+	int num_args = sscanf(args, "%d %d %d %d", &width, &height, &stride, &candidate_distance);
+	if (
+		num_args < 3
+		|| width < 1 || width > INT8_MAX
+		|| height < 1 || height > INT8_MAX
+		|| stride < 1 || stride > INT8_MAX
+		|| candidate_distance < 0 || candidate_distance > MNK_MAX_CANDIDATE_DISTANCE
+	) {
+		mnkd_reply(client, "error usage: new <session> <width> <height> <stride> [candidate_distance]");
+		return;
+	}
+
+	mnkd_session_t* session = mnkd_find_session(daemon, name);
+	if (session != NULL) {
+		if (session->searcher != NULL) {
+			mnkd_reply(client, "error busy");
+			return;
+		}
+		mnkd_destroy_session(daemon, session);
+	}
+
+	mnk_config_t config = {
+		.width = width,
+		.height = height,
+		.stride = stride,
+		.candidate_distance = candidate_distance,
+	};
+	session = malloc(sizeof(mnkd_session_t));
+	*session = (mnkd_session_t){
+		.state = mnk_state_create(&config),
+		.last_used_ns = mnkd_clock_ns(),
+	};
+	strcpy(session->name, name);
+	session->ai = mnk_ai_create(&(mnk_ai_config_t){
+		.game_config = config,
+		.initial_state = session->state,
+		.num_threads = 1,
+		// Searches are bounded by time only
+		.num_iterations = INT_MAX,
+		.arena_region_size = MNKD_ARENA_REGION_SIZE,
+	});
+	if (session->ai == NULL) {
+		mnk_state_destroy(session->state);
+		free(session);
+		mnkd_reply(client, "error out of memory");
+		return;
+	}
+
+	if (daemon->num_sessions == daemon->sessions_capacity) {
+		daemon->sessions_capacity = daemon->sessions_capacity > 0 ? daemon->sessions_capacity * 2 : 16;
+		daemon->sessions = realloc(daemon->sessions, sizeof(mnkd_session_t*) * daemon->sessions_capacity);
+	}
+	daemon->sessions[daemon->num_sessions++] = session;
+
+	mnkd_enforce_memory_limit(daemon, session);
+	mnkd_reply(client, "ok");
+}
+
+static void
+mnkd_apply(mnkd_client_t* client, mnkd_session_t* session, const char* args) {
+	int x, y;
+	if (sscanf(args, "%d %d", &x, &y) != 2) {
+		mnkd_reply(client, "error usage: apply <session> <x> <y>");
+		return;
+	}
+
+	mnk_state_t* state = session->state;
+	if (state->player == -1) {
+		mnkd_reply(client, "error game over");
+	} else if (
+		x < 0 || x >= state->config.width
+		|| y < 0 || y >= state->config.height
+		|| mnk_state_get(state, x, y) != -1
+	) {
+		mnkd_reply(client, "error illegal move");
+	} else {
+		mnk_move_t move = { .x = x, .y = y };
+		mnk_state_apply(state, move);
+		mnk_ai_apply(session->ai, move);
+		mnkd_reply(client, "ok");
+	}
+}
+
+static void
+mnkd_search(mnkd_client_t* client, mnkd_session_t* session, const char* args) {
+	int ms;
+	if (sscanf(args, "%d", &ms) != 1 || ms < 0) {
+		mnkd_reply(client, "error usage: search <session> <ms>");
+		return;
+	}
+	if (session->state->player == -1) {
+		mnkd_reply(client, "error game over");
+		return;
+	}
+
+	session->searcher = client;
+	session->search_deadline_ns = mnkd_clock_ns() + (uint64_t)ms * 1000000u;
+	client->waiting_on = session;
+}
+
+static void
+mnkd_snapshot(mnkd_client_t* client, mnkd_session_t* session, const char* args) {
+	int max_moves = INT_MAX;
+	if (sscanf(args, "%d", &max_moves) == 1 && max_moves < 0) {
+		mnkd_reply(client, "error usage: snapshot <session> [max_moves]");
+		return;
+	}
+
+	const mnk_config_t* config = &session->state->config;
+	int area = config->width * config->height;
+	if (max_moves > area) { max_moves = area; }
+	mnk_move_t pv[MNKD_MAX_PV_LENGTH];
+	mnk_ai_snapshot_t snapshot = {
+		.moves = malloc(sizeof(mnk_ai_move_stats_t) * (max_moves > 0 ? max_moves : 1)),
+		.max_moves = max_moves,
+		.pv = pv,
+		.max_pv_length = MNKD_MAX_PV_LENGTH,
+	};
+	mnk_ai_snapshot(session->ai, &snapshot);
+
+	// Room for every move and the principal variation at their widest
+	size_t capacity = 64 + (size_t)snapshot.num_moves * 40 + MNKD_MAX_PV_LENGTH * 10;
+	char* line = malloc(capacity);
+	int length = snprintf(line, capacity, "snapshot %d %d", snapshot.num_visits, snapshot.num_moves);
+	for (int i = 0; i < snapshot.num_moves; ++i) {
+		const mnk_ai_move_stats_t* move = &snapshot.moves[i];
+		length += snprintf(
+			line + length, capacity - length,
+			" %d %d %d %.4f",
+			move->move.x, move->move.y, move->num_visits, move->win_rate
+		);
+	}
+	length += snprintf(line + length, capacity - length, " pv %d", snapshot.pv_length);
+	for (int i = 0; i < snapshot.pv_length; ++i) {
+		length += snprintf(line + length, capacity - length, " %d %d", pv[i].x, pv[i].y);
+	}
+
+	// Too long for mnkd_reply
+	line[length++] = '\n';
+	for (int offset = 0; offset < length && !client->closed;) {
+		ssize_t num_written = send(client->fd, line + offset, length - offset, MSG_NOSIGNAL);
+		if (num_written < 0) {
+			if (errno == EINTR) { continue; }
+			client->closed = true;
+		} else {
+			offset += num_written;
+		}
+	}
+
+	free(line);
+	free(snapshot.moves);
+}
+
+static void
+mnkd_execute(mnkd_t* daemon, mnkd_client_t* client, char* line) {
+	char command[16];
+	char name[MNKD_MAX_NAME_LENGTH + 1];
+	int args_offset = 0;
+	int num_fields = sscanf(line, "%15s %n%63s %n", command, &args_offset, name, &args_offset);
+	if (num_fields < 1) { return; }  // Blank line
+	const char* args = line + args_offset;
+
+	if (strcmp(command, "stats") == 0) {
+		mnkd_reply(
+			client, "stats %d %zu %zu",
+			daemon->num_sessions, mnkd_memory_usage(daemon), daemon->max_memory
+		);
+		return;
+	}
+
+	static const char* const session_commands[] = { "new", "apply", "search", "snapshot", "close" };
+	bool known = false;
+	for (size_t i = 0; i < sizeof(session_commands) / sizeof(session_commands[0]); ++i) {
+		known |= strcmp(command, session_commands[i]) == 0;
+	}
+	if (!known) {
+		mnkd_reply(client, "error unknown command");
+		return;
+	}
+	if (num_fields < 2) {
+		mnkd_reply(client, "error missing session");
+		return;
+	}
+	if (strcmp(command, "new") == 0) {
+		mnkd_new(daemon, client, name, args);
+		return;
+	}
+
+	mnkd_session_t* session = mnkd_find_session(daemon, name);
+	if (session == NULL) {
+		mnkd_reply(client, "error no such session");
+		return;
+	}
+	if (session->searcher != NULL) {
+		mnkd_reply(client, "error busy");
+		return;
+	}
+	session->last_used_ns = mnkd_clock_ns();
+
+	if (strcmp(command, "apply") == 0) {
+		mnkd_apply(client, session, args);
+	} else if (strcmp(command, "search") == 0) {
+		mnkd_search(client, session, args);
+	} else if (strcmp(command, "snapshot") == 0) {
+		mnkd_snapshot(client, session, args);
+	} else {
+		mnkd_destroy_session(daemon, session);
+		mnkd_reply(client, "ok");
+	}
+}
+
+// Run the complete lines received so far, until one starts a search
+static void
+mnkd_process_input(mnkd_t* daemon, mnkd_client_t* client) {
+	size_t start = 0;
+	while (client->waiting_on == NULL && !client->closed) {
+		char* end = memchr(client->input + start, '\n', client->input_size - start);
+		if (end == NULL) { break; }
+
+		*end = '\0';
+		mnkd_execute(daemon, client, client->input + start);
+		start = end + 1 - client->input;
+	}
+
+	memmove(client->input, client->input + start, client->input_size - start);
+	client->input_size -= start;
+	if (client->input_size == sizeof(client->input) && client->waiting_on == NULL) {
+		mnkd_reply(client, "error line too long");
+		client->closed = true;
+	}
+}
+
+static void
+mnkd_read(mnkd_t* daemon, mnkd_client_t* client) {
+	ssize_t num_read = recv(
+		client->fd,
+		client->input + client->input_size,
+		sizeof(client->input) - client->input_size,
+		0
+	);
+	if (num_read <= 0) {
+		if (num_read < 0 && errno == EINTR) { return; }
+		client->closed = true;
+		return;
+	}
+
+	client->input_size += num_read;
+	mnkd_process_input(daemon, client);
+}
+
+static void
+mnkd_accept(mnkd_t* daemon, int listen_fd) {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) { return; }
+
+	if (daemon->num_clients == daemon->clients_capacity) {
+		daemon->clients_capacity = daemon->clients_capacity > 0 ? daemon->clients_capacity * 2 : 16;
+		daemon->clients = realloc(daemon->clients, sizeof(mnkd_client_t*) * daemon->clients_capacity);
+	}
+	mnkd_client_t* client = malloc(sizeof(mnkd_client_t));
+	*client = (mnkd_client_t){ .fd = fd };
+	daemon->clients[daemon->num_clients++] = client;
+}
+
+static void
+mnkd_drop_closed_clients(mnkd_t* daemon) {
+	for (int i = 0; i < daemon->num_clients;) {
+		mnkd_client_t* client = daemon->clients[i];
+		if (!client->closed) {
+			++i;
+			continue;
+		}
+
+		// Its search is abandoned, the tree keeps what it found
+		if (client->waiting_on != NULL) {
+			client->waiting_on->searcher = NULL;
+		}
+		close(client->fd);
+		free(client);
+		daemon->clients[i] = daemon->clients[--daemon->num_clients];
+	}
+}
+
+// Give every running search a slice, then answer those which are done
+static bool
+mnkd_run_searches(mnkd_t* daemon) {
+	for (int i = 0; i < daemon->num_sessions; ++i) {
+		mnkd_session_t* session = daemon->sessions[i];
+		mnkd_client_t* client = session->searcher;
+		if (client == NULL) { continue; }
+
+		uint64_t now = mnkd_clock_ns();
+		if (now < session->search_deadline_ns) {
+			uint64_t time_left = session->search_deadline_ns - now;
+			mnk_ai_step(session->ai, time_left < MNKD_SLICE_NS ? time_left : MNKD_SLICE_NS);
+			now = mnkd_clock_ns();
+		}
+		session->last_used_ns = now;
+
+		if (now >= session->search_deadline_ns) {
+			mnk_move_t move = mnk_ai_best_move(session->ai);
+			session->searcher = NULL;
+			client->waiting_on = NULL;
+			mnkd_reply(client, "move %d %d", move.x, move.y);
+			// Its next commands may create or destroy sessions, so they wait
+			// until the loop is over
+			client->resume_input = true;
+		}
+	}
+
+	for (int i = 0; i < daemon->num_clients; ++i) {
+		mnkd_client_t* client = daemon->clients[i];
+		if (!client->resume_input) { continue; }
+
+		client->resume_input = false;
+		mnkd_process_input(daemon, client);
+	}
+
+	bool searching = false;
+	for (int i = 0; i < daemon->num_sessions; ++i) {
+		searching |= daemon->sessions[i]->searcher != NULL;
+	}
+	return searching;
+}
+
+static int
+mnkd_listen(const char* path) {
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (
+		bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0
+		|| listen(fd, MNKD_LISTEN_BACKLOG) < 0
+	) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <socket> [max_memory_mb]\n", argv[0]);
+		return 1;
+	}
+
+	mnkd_t daemon = {
+		.max_memory = (size_t)(argc > 2 ? atoi(argv[2]) : MNKD_DEFAULT_MAX_MEMORY_MB) << 20,
+	};
+
+	int listen_fd = mnkd_listen(argv[1]);
+	if (listen_fd < 0) { return 1; }
+
+	struct sigaction action = { .sa_handler = mnkd_stop };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	struct pollfd* fds = NULL;
+	int fds_capacity = 0;
+	bool searching = false;
+	while (mnkd_running) {
+		if (daemon.num_clients + 1 > fds_capacity) {
+			fds_capacity = (daemon.num_clients + 1) * 2;
+			fds = realloc(fds, sizeof(struct pollfd) * fds_capacity);
+		}
+		fds[0] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+		for (int i = 0; i < daemon.num_clients; ++i) {
+			// Input of clients waiting on a search stays in the socket
+			const mnkd_client_t* client = daemon.clients[i];
+			fds[i + 1] = (struct pollfd){
+				.fd = client->fd,
+				.events = client->waiting_on == NULL ? POLLIN : 0,
+			};
+		}
+
+		// Only check for requests between slices while searching
+		int num_fds = daemon.num_clients + 1;
+		if (poll(fds, num_fds, searching ? 0 : -1) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		for (int i = 1; i < num_fds; ++i) {
+			if (fds[i].events != 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+				mnkd_read(&daemon, daemon.clients[i - 1]);
+			}
+		}
+		if ((fds[0].revents & POLLIN) != 0) {
+			mnkd_accept(&daemon, listen_fd);
+		}
+
+		searching = mnkd_run_searches(&daemon);
+		mnkd_drop_closed_clients(&daemon);
+		mnkd_enforce_memory_limit(&daemon, NULL);
+	}
+
+	for (int i = 0; i < daemon.num_clients; ++i) {
+		close(daemon.clients[i]->fd);
+		free(daemon.clients[i]);
+	}
+	while (daemon.num_sessions > 0) {
+		mnkd_destroy_session(&daemon, daemon.sessions[0]);
+	}
+	close(listen_fd);
+	unlink(argv[1]);
+	free(daemon.clients);
+	free(daemon.sessions);
+	free(fds);
+
+	return 0;
+}
@@ -13,6 +13,36 @@
 #	define MONTE_INDEX_TYPE int32_t
 #endif
 
+// Visit counters. When a node reaches MONTE_VISIT_MAX visits (or fewer, see
+// MONTE_VALUE_TYPE), its visits and value are halved, which keeps its win
+// rate. Define both for a compact type.
+// With MONTE_ENABLE_SHARED, leave room above MONTE_VISIT_MAX for the visits
+// of concurrent searchers.
+#ifndef MONTE_VISIT_TYPE
+#	define MONTE_VISIT_TYPE int32_t
+#	ifndef MONTE_VISIT_MAX
+#		define MONTE_VISIT_MAX (INT32_MAX / 2)
+#	endif
+#endif
+
+#ifndef MONTE_VISIT_MAX
+#	error "MONTE_VISIT_MAX must be defined along with MONTE_VISIT_TYPE"
+#endif
+
+// Sum of the rewards of a node. Rewards are multiplied by MONTE_VALUE_SCALE
+// and rounded before they are added to an integer type, so the type must hold
+// MONTE_VISIT_MAX * MONTE_VALUE_SCALE. A floating point sum stops changing by
+// a whole reward at 2^mantissa digits (2^24 for float), so nodes are rescaled
+// once their visits times MONTE_VALUE_SCALE reach it, even below
+// MONTE_VISIT_MAX. Rewards below 1 already lose precision on the way there.
+#ifndef MONTE_VALUE_TYPE
+#	define MONTE_VALUE_TYPE float
+#endif
+
+#ifndef MONTE_VALUE_SCALE
+#	define MONTE_VALUE_SCALE 1
+#endif
+
 #ifndef MONTE_PLAYER_ID_TYPE
 #	define MONTE_PLAYER_ID_TYPE int8_t
 #endif
@@ -44,18 +74,24 @@
 #define MONTE_INVALID_PLAYER ((MONTE_INDEX_TYPE)-1)
 
 typedef MONTE_INDEX_TYPE monte_index_t;
+typedef MONTE_VISIT_TYPE monte_visit_t;
+typedef MONTE_VALUE_TYPE monte_value_t;
 typedef MONTE_PLAYER_ID_TYPE monte_player_id_t;
 typedef MONTE_GAME_CONFIG_TYPE monte_game_config_t;
 typedef MONTE_STATE_TYPE monte_state_t;
 typedef MONTE_MOVE_TYPE monte_move_t;
 typedef MONTE_ALLOCATOR_CTX_TYPE monte_allocator_ctx_t;
 typedef MONTE_RNG_STATE_TYPE monte_rng_state_t;
-typedef uint64_t monte_hash_t;
 typedef struct monte_s monte_t;
 
+#ifdef MONTE_MOVE_CURSOR_TYPE
+typedef MONTE_MOVE_CURSOR_TYPE monte_move_cursor_t;
+#endif
+
 typedef struct monte_state_info_s {
 	monte_player_id_t current_player;
-	monte_index_t scores[];
+	// One per player
+	monte_index_t* scores;
 } monte_state_info_t;
 
 typedef struct monte_iterator_s monte_iterator_t;
@@ -65,6 +101,35 @@ typedef struct monte_config_s {
 	float exploration_param;
 	monte_game_config_t game_config;
 
+	// Stop playouts after this many moves and score them with
+	// monte_user_evaluate_state (requires MONTE_ENABLE_EVALUATION).
+	// 0 plays until the game ends.
+	monte_index_t max_rollout_depth;
+
+	// Progressive widening: a node may have at most
+	// ceil(widening_coefficient * num_visits ^ widening_exponent) children.
+	// With MONTE_ENABLE_MOVE_PRIORITY, the highest priority moves are added
+	// first. A coefficient of 0 disables widening.
+	float widening_coefficient;
+	float widening_exponent;
+
+#ifdef MONTE_ENABLE_SHARED
+	// Counted against a node while an iteration through it is in flight, so
+	// that concurrent searchers spread out
+	float virtual_loss;
+#endif
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+	// Root moves in the first round of monte_start_halving, 0 for all of
+	// them. With MONTE_ENABLE_MOVE_PRIORITY, the highest priority moves are
+	// taken.
+	monte_index_t halving_num_candidates;
+	// Scale of the Gumbel noise added to the priorities when candidates are
+	// picked and ranked, 0 for none (plain sequential halving).
+	// https://openreview.net/forum?id=bERaNdoegnO
+	float halving_gumbel_scale;
+#endif
+
 	monte_allocator_ctx_t* allocator_ctx;
 	monte_rng_state_t rng_state;
 } monte_config_t;
@@ -89,31 +154,297 @@ monte_user_apply_move(monte_state_t* state, const monte_move_t* move);
 MONTE_USER_FN void
 monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info);
 
+#ifdef MONTE_ENABLE_APPLY_AND_INSPECT
+// monte_user_apply_move followed by monte_user_inspect_state, for games which
+// learn the outcome while applying the move anyway. Used instead of the pair
+// in selection, expansion and playouts.
+MONTE_USER_FN void
+monte_user_apply_and_inspect(
+	monte_state_t* state,
+	const monte_move_t* move,
+	monte_state_info_t* info
+);
+#endif
+
+#ifdef MONTE_MOVE_CURSOR_TYPE
+// Generator-style alternative to monte_user_iterate_moves.
+// `cursor` starts zero-initialized. Write the next move and return true, or
+// return false once all moves have been produced.
+// Being a direct call, the enumeration can be inlined into the sampler.
+MONTE_USER_FN bool
+monte_user_next_move(
+	const monte_state_t* state,
+	monte_move_cursor_t* cursor,
+	monte_move_t* move
+);
+
+#define MONTE_FOREACH_MOVE(state, move) \
+	for ( \
+		monte_move_cursor_t monte_foreach_cursor = { 0 }; \
+		monte_user_next_move((state), &monte_foreach_cursor, &(move)); \
+	)
+#else
 MONTE_USER_FN void
 monte_user_iterate_moves(const monte_state_t* state, monte_iterator_t* iterator);
+#endif
 
 MONTE_USER_FN bool
 monte_user_moves_equal(const monte_move_t* lhs, const monte_move_t* rhs);
 
-MONTE_USER_FN monte_hash_t
-monte_user_hash_move(const monte_move_t* move);
+#ifdef MONTE_ENABLE_UNDO
+// Revert `move`, which was the last move applied to `state`.
+// Iterations then work on a single state instead of copying it each time.
+MONTE_USER_FN void
+monte_user_undo_move(monte_state_t* state, const monte_move_t* move);
+#endif
+
+#ifdef MONTE_ENABLE_ROLLOUT_POLICY
+// Pick the next move of a playout.
+// Return false to fall back to a uniformly random move.
+MONTE_USER_FN bool
+monte_user_pick_rollout_move(
+	const monte_state_t* state,
+	monte_rng_state_t* rng_state,
+	monte_move_t* move
+);
+#endif
+
+#ifdef MONTE_ENABLE_EVALUATION
+// Estimate the outcome of a non-terminal state, one value per player, on the
+// same scale as monte_state_info_t.scores.
+MONTE_USER_FN void
+monte_user_evaluate_state(const monte_state_t* state, float* values);
+#endif
+
+#ifdef MONTE_ENABLE_MOVE_PRIORITY
+// Rank the moves of a state for expansion. Higher goes first.
+MONTE_USER_FN float
+monte_user_move_priority(const monte_state_t* state, const monte_move_t* move);
+#endif
+
+#ifdef MONTE_ENABLE_CANONICALIZATION
+// Map a move to a canonical representative among the moves which are
+// equivalent to it under the symmetries of `state`. Only canonical moves are
+// expanded.
+MONTE_USER_FN void
+monte_user_canonicalize(const monte_state_t* state, monte_move_t* move);
+#endif
+
+#ifdef MONTE_BATCH_SIZE
+// Play out every state in `states` as monte_iterate would: until the game
+// ends, or for max_depth moves if it is not 0 and then scored as
+// monte_user_evaluate_state would. Playing them out in place is allowed.
+// The outcome of states[i] is written to values[i * num_players + player].
+// States which are already terminal must be reported as-is.
+MONTE_USER_FN void
+monte_user_simulate_batch(
+	monte_state_t* const states[],
+	monte_index_t num_states,
+	monte_index_t max_depth,
+	monte_rng_state_t* rng_state,
+	float* values
+);
+#endif
 
 // API
 
 MONTE_API monte_t*
 monte_create(const monte_state_t* initial_state, monte_config_t config);
 
+#ifdef MONTE_ENABLE_SHARED
+// Search a tree which lives in `memory`, e.g. a POSIX shared memory segment
+// mapped by several processes, not necessarily at the same address.
+// Every process or thread searching the tree needs its own monte_t and they
+// can all iterate at once. One of them creates the tree with `initialize`,
+// attaching returns NULL until that is done.
+// Nodes are allocated from `memory` and never recycled. Once it is full,
+// the tree stops growing. Everyone must call monte_apply_move with the same
+// moves, while nobody is iterating.
+MONTE_API monte_t*
+monte_create_shared(
+	const monte_state_t* initial_state,
+	monte_config_t config,
+	void* memory,
+	size_t size,
+	bool initialize
+);
+#endif
+
+// Advance the game, keeping the subtree of the move.
+// With MONTE_ENABLE_CANONICALIZATION, the canonical image of the move is
+// played instead, whose subtree is the one in the tree. The search may then
+// follow a symmetric image of the game, to which the caller maps its moves
+// and from which it maps back the picked ones.
 MONTE_API void
 monte_apply_move(monte_t* monte, const monte_move_t* move);
 
 MONTE_API void
 monte_iterate(monte_t* monte);
 
+#ifdef MONTE_BATCH_SIZE
+// Run MONTE_BATCH_SIZE iterations, handing all their leaves to
+// monte_user_simulate_batch at once.
+MONTE_API void
+monte_iterate_batch(monte_t* monte);
+#endif
+
 MONTE_API void
 monte_pick_move(monte_t* monte, monte_move_t* move, float* score);
 
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+// Spend the next num_iterations iterations on the root moves with
+// sequential halving instead of UCT: the budget is split in rounds, each
+// candidate gets an equal share of a round and the worse half is dropped
+// after it. Deeper nodes still use UCT. Until the next monte_apply_move,
+// monte_pick_move returns the best remaining candidate.
+// Every root move is expanded right away.
+MONTE_API void
+monte_start_halving(monte_t* monte, monte_index_t num_iterations);
+#endif
+
+#ifndef MONTE_MOVE_CURSOR_TYPE
 MONTE_API void
 monte_submit_move(monte_iterator_t* itr, const monte_move_t* move);
+#endif
+
+#ifdef MONTE_ENABLE_SNAPSHOT
+typedef struct monte_snapshot_child_s {
+	monte_move_t move;
+	monte_visit_t num_visits;
+	// Average outcome for the player to move at the root, from -1 to 1
+	float win_rate;
+} monte_snapshot_child_t;
+
+typedef struct monte_snapshot_s {
+	// Provided by the caller
+	monte_snapshot_child_t* children;
+	monte_index_t max_children;
+	monte_move_t* pv;
+	monte_index_t max_pv_length;
+
+	// Filled in by monte_snapshot
+	monte_visit_t num_visits;
+	monte_index_t num_children;
+	monte_index_t pv_length;
+} monte_snapshot_t;
+
+// Read the root children and the principal variation (most visited moves)
+// while other threads keep iterating, without locks.
+// Counters are read one by one, so they may be slightly out of sync with
+// each other. Must not run concurrently with monte_apply_move, which recycles
+// nodes.
+MONTE_API void
+monte_snapshot(const monte_t* monte, monte_snapshot_t* out);
+#endif
+
+#ifdef MONTE_ENABLE_COMPACTION
+// Move the tree into one contiguous block, in breadth-first order, so that
+// selection walks through memory which was scattered across moves. The block
+// is reused every other compaction, so memory stays bounded over a game.
+// Best called after monte_apply_move, it must not run concurrently with
+// anything else on this monte_t.
+// Return false if out of memory or the tree is shared, leaving it as is.
+MONTE_API bool
+monte_compact(monte_t* monte);
+#endif
+
+#ifdef MONTE_ENABLE_STEP
+// Iterate for about max_ns nanoseconds, or until max_iterations iterations
+// are done, then return the number of iterations done. The clock is read
+// after runs of iterations sized from the measured speed, so the deadline is
+// overshot by about one iteration. Nothing is left half done: the search can
+// be resumed with another call or abandoned between any two calls.
+MONTE_API monte_index_t
+monte_step(monte_t* monte, uint64_t max_ns, monte_index_t max_iterations);
+
+#ifdef MONTE_BATCH_SIZE
+// monte_step with runs of monte_iterate_batch. The deadline is overshot by
+// about one batch, and iterations short of a batch before max_iterations are
+// run one by one.
+MONTE_API monte_index_t
+monte_step_batch(monte_t* monte, uint64_t max_ns, monte_index_t max_iterations);
+#endif
+#endif
+
+#ifdef MONTE_ENABLE_TRACE
+// Receives the trace in chunks, to be concatenated
+typedef void (*monte_trace_fn_t)(void* userdata, const void* data, size_t size);
+
+// Log what every following iteration does to the tree: the path it selected,
+// the node it expanded and the outcome of its rollout, along with root moves.
+// Start right after monte_create, on a tree which has not been searched.
+// Pass NULL to stop and flush what is left.
+// Only this monte_t is logged, so a shared tree can not be replayed.
+MONTE_API void
+monte_trace(monte_t* monte, monte_trace_fn_t fn, void* userdata);
+#endif
+
+#ifdef MONTE_ENABLE_REPLAY
+// Rebuild the tree from a complete trace, on a monte_t fresh from
+// monte_create. Selection and backpropagation run as in a search, everything
+// the game would decide comes from the trace and no monte_user_* function is
+// called, except for allocation. Moves in the tree are left zeroed.
+// Children chosen by UCT which differ from the logged ones (e.g. from a
+// build with different value types) are counted in num_divergences and the
+// logged path is followed.
+// Return the number of iterations replayed, or -1 if the trace is malformed.
+MONTE_API monte_index_t
+monte_replay(
+	monte_t* monte,
+	const void* trace,
+	size_t size,
+	monte_index_t* num_divergences
+);
+#endif
+
+#ifdef MONTE_ENABLE_SCHEDULER
+// A fixed pool of workers shared by many searches.
+// Jobs are time-sliced round-robin and each job is run by at most one worker
+// at a time, so its monte_t needs no locking. Do not touch the monte_t of a
+// job until it is done.
+
+typedef struct monte_scheduler_s monte_scheduler_t;
+typedef struct monte_job_s monte_job_t;
+
+typedef struct monte_scheduler_config_s {
+	int num_workers;
+	// How long a job runs before yielding to the next one, 0 for 1ms
+	uint64_t time_slice_ns;
+	monte_allocator_ctx_t* allocator_ctx;
+} monte_scheduler_config_t;
+
+// Owned by the caller and must stay alive until `done` is called.
+// At least one of num_iterations and time_budget_ns must be set.
+struct monte_job_s {
+	monte_t* monte;
+	// Stop after this many iterations, 0 for no limit
+	monte_index_t num_iterations;
+	// Stop this long after submission, 0 for no limit
+	uint64_t time_budget_ns;
+#ifdef MONTE_BATCH_SIZE
+	// Run monte_iterate_batch instead of monte_iterate
+	bool batch;
+#endif
+	// Called on a worker thread once the job is done
+	void (*done)(monte_job_t* job);
+	void* userdata;
+
+	// Set by the scheduler
+	monte_index_t num_iterations_done;
+	uint64_t deadline_ns;
+	monte_job_t* next;
+};
+
+MONTE_API monte_scheduler_t*
+monte_scheduler_create(monte_scheduler_config_t config);
+
+// Jobs which are still queued are dropped without calling `done`
+MONTE_API void
+monte_scheduler_destroy(monte_scheduler_t* scheduler);
+
+MONTE_API void
+monte_scheduler_submit(monte_scheduler_t* scheduler, monte_job_t* job);
+#endif
 
 #endif
 
@@ -122,39 +453,271 @@ monte_submit_move(monte_iterator_t* itr, const monte_move_t* move);
 #include <math.h>
 #include <string.h>
 
-#ifndef MONTE_HAMT_NUMBITS
-#	define MONTE_HAMT_NUM_BITS 2
+#if defined(MONTE_ENABLE_MOVE_PRIORITY) || defined(MONTE_ENABLE_SEQUENTIAL_HALVING)
+#	include <stdlib.h>
+#endif
+
+#include <float.h>
+
+#ifdef __cplusplus
+#	define MONTE_ALIGNOF(type) alignof(type)
+#else
+#	define MONTE_ALIGNOF(type) _Alignof(type)
+#endif
+
+// Search parameters of monte_config_t are read through MONTE_CONFIG, which
+// can be defined to compile time constants for the compiler to fold. It
+// covers num_players, exploration_param, max_rollout_depth,
+// widening_coefficient and widening_exponent.
+#ifndef MONTE_CONFIG
+#	define MONTE_CONFIG(monte, field) ((monte)->config.field)
+#endif
+
+#ifndef MONTE_UNDO_BUFFER_SIZE
+#	define MONTE_UNDO_BUFFER_SIZE 256
+#endif
+
+// Untried move lists come in power of two sizes, from
+// MONTE_MOVE_LIST_MIN_CAPACITY moves up
+#define MONTE_MOVE_LIST_MIN_CAPACITY 4
+#define MONTE_MOVE_LIST_NUM_CLASSES 24
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+// Transform of the win rate in Gumbel ranking: (c_visit + max visits) *
+// c_scale * q. c_scale is half that of the paper, where q is in [0, 1].
+#	define MONTE_HALVING_C_VISIT 50.f
+#	define MONTE_HALVING_C_SCALE 0.5f
+#endif
+
+#if defined(MONTE_ENABLE_SCHEDULER) || defined(MONTE_ENABLE_STEP)
+#	include <time.h>
+#endif
+
+#if defined(MONTE_ENABLE_TRACE) || defined(MONTE_ENABLE_REPLAY)
+#	define MONTE_TRACE_VERSION 1
+#	define MONTE_TRACE_BUFFER_SIZE 4096
+// Iterations selected but not yet backpropagated, as in monte_iterate_batch
+#	define MONTE_TRACE_MAX_PENDING 256
+
+// A trace starts with "MNTR", the version, the number of players, the
+// exploration and widening parameters and the player at the root. Records
+// follow, each starting with its type. Integers are LEB128, floats are
+// little endian and players are stored plus one, so that 0 is none.
+//
+// An expansion is a byte of flags, the number of moves if it was the first
+// one and the player of the new child if there is one.
+enum {
+	// Positions in the list of the children on the path plus one, until 0.
+	// An expansion of the leaf, then the winner if the game ended there.
+	MONTE_TRACE_SELECT,
+	// The same, where sequential halving picked the first child
+	MONTE_TRACE_SELECT_CANDIDATE,
+	// Rollout values, for the oldest selection which has none yet
+	MONTE_TRACE_BACKUP,
+	// An expansion of the root outside of an iteration
+	MONTE_TRACE_EXPAND,
+	// Position of the new root plus one, or 0 and its player
+	MONTE_TRACE_APPLY,
+};
+
+enum {
+	MONTE_TRACE_FIRST_EXPANSION = 1 << 0,
+	MONTE_TRACE_EXPANDED = 1 << 1,
+};
+#endif
+
+#ifdef MONTE_ENABLE_SCHEDULER
+#	include <threads.h>
+
+#	ifndef MONTE_SCHEDULER_CLOCK_INTERVAL
+// Iterations between clock reads
+#		define MONTE_SCHEDULER_CLOCK_INTERVAL 64
+#	endif
+
+#	define MONTE_SCHEDULER_DEFAULT_TIME_SLICE_NS 1000000
 #endif
 
-#define MONTE_HAMT_NUM_CHILDREN (1 << MONTE_HAMT_NUM_BITS)
-#define MONTE_HAMT_MASK (((monte_hash_t)1 << MONTE_HAMT_NUM_BITS) - 1)
+#if defined(MONTE_ENABLE_SNAPSHOT) || defined(MONTE_ENABLE_SHARED)
+// Fields read by monte_snapshot are atomic. With a single searcher, only
+// it writes them, so relaxed loads and stores suffice. New nodes are
+// initialized before they are published with a release store.
+#	include <stdatomic.h>
+#	define MONTE_ATOMIC(type) _Atomic(type)
+#	define MONTE_LOAD(ptr) atomic_load_explicit((ptr), memory_order_relaxed)
+#	define MONTE_STORE(ptr, value) atomic_store_explicit((ptr), (value), memory_order_relaxed)
+#	define MONTE_LOAD_ACQUIRE(ptr) atomic_load_explicit((ptr), memory_order_acquire)
+#	define MONTE_PUBLISH(ptr, value) atomic_store_explicit((ptr), (value), memory_order_release)
+#else
+#	define MONTE_ATOMIC(type) type
+#	define MONTE_LOAD(ptr) (*(ptr))
+#	define MONTE_STORE(ptr, value) (*(ptr) = (value))
+#	define MONTE_LOAD_ACQUIRE(ptr) (*(ptr))
+#	define MONTE_PUBLISH(ptr, value) (*(ptr) = (value))
+#endif
+
+#ifdef MONTE_ENABLE_SHARED
+// Several searchers write the same nodes
+#	define MONTE_ADD(ptr, value) \
+	atomic_fetch_add_explicit((ptr), (value), memory_order_relaxed)
+#	define MONTE_ADD_VALUE(ptr, value) monte_atomic_add_value((ptr), (value))
+#	define MONTE_CAS(ptr, expected, desired) \
+	atomic_compare_exchange_strong_explicit( \
+		(ptr), (expected), (desired), memory_order_relaxed, memory_order_relaxed \
+	)
+#else
+#	define MONTE_ADD(ptr, value) MONTE_STORE((ptr), MONTE_LOAD(ptr) + (value))
+#	define MONTE_ADD_VALUE(ptr, value) MONTE_ADD((ptr), (value))
+#	define MONTE_CAS(ptr, expected, desired) \
+	(MONTE_LOAD(ptr) == *(expected) \
+		? (MONTE_STORE((ptr), (desired)), true) \
+		: (*(expected) = MONTE_LOAD(ptr), false))
+#endif
+
+#define MONTE_MIXED_PLAYER ((monte_player_id_t)-2)
 
 typedef struct monte_node_s monte_node_t;
+typedef struct monte_move_list_s monte_move_list_t;
+
+// Links between nodes are offsets from monte_t.base. It is 0 unless the tree
+// is shared, making them plain pointers.
+typedef uintptr_t monte_ref_t;
+typedef MONTE_ATOMIC(monte_ref_t) monte_link_t;
+
+// The moves of a list follow it, at MONTE_MOVE_LIST_HEADER_SIZE
+struct monte_move_list_s {
+	// Next free list of the same size class
+	monte_move_list_t* next;
+	int size_class;
+};
 
-struct monte_node_s {
-	monte_node_t* hamt[MONTE_HAMT_NUM_CHILDREN];
+#define MONTE_MOVE_LIST_HEADER_SIZE \
+	((sizeof(monte_move_list_t) + MONTE_ALIGNOF(monte_move_t) - 1) \
+		/ MONTE_ALIGNOF(monte_move_t) * MONTE_ALIGNOF(monte_move_t))
+#define MONTE_MOVE_LIST_ALIGNMENT \
+	(MONTE_ALIGNOF(monte_move_list_t) > MONTE_ALIGNOF(monte_move_t) \
+		? MONTE_ALIGNOF(monte_move_list_t) \
+		: MONTE_ALIGNOF(monte_move_t))
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+typedef struct {
+	monte_node_t* node;
+	// Priority plus Gumbel noise, fixed for the whole search
+	float noise;
+	float score;
+} monte_halving_candidate_t;
+#endif
+
+// A move collected during expansion, before it is sorted into a move list
+typedef struct {
 	monte_move_t move;
-	monte_index_t num_moves_left;
-	monte_node_t* next;
-	monte_node_t* children;
-	monte_player_id_t instant_winner;
+#ifdef MONTE_ENABLE_MOVE_PRIORITY
+	float priority;
+#endif
+} monte_untried_move_t;
 
-	monte_node_t* parent;
+// Outgrown monte_t.tmp_moves buffers are recycled as move lists. An untried
+// move is at least as aligned as a move.
+#define MONTE_TMP_MOVES_ALIGNMENT \
+	(MONTE_ALIGNOF(monte_move_list_t) > MONTE_ALIGNOF(monte_untried_move_t) \
+		? MONTE_ALIGNOF(monte_move_list_t) \
+		: MONTE_ALIGNOF(monte_untried_move_t))
+
+struct monte_node_s {
+	monte_move_t move;
+	// Untried moves are popped from the end of untried_moves.
+	// -1 until the node is first expanded.
+	MONTE_ATOMIC(monte_index_t) num_moves_left;
+	monte_ref_t untried_moves;
+	MONTE_ATOMIC(monte_index_t) num_children;
+	monte_link_t next;
+	monte_link_t children;
+	MONTE_ATOMIC(monte_player_id_t) instant_winner;
+	// Winner shared by all proven children, MONTE_MIXED_PLAYER if they differ
+	MONTE_ATOMIC(monte_player_id_t) proven_winner;
+	MONTE_ATOMIC(monte_index_t) num_proven_children;
+
+	monte_ref_t parent;
 	monte_player_id_t current_player;
-	monte_index_t num_wins;
-	monte_index_t num_visits;
+	MONTE_ATOMIC(monte_value_t) value;
+	MONTE_ATOMIC(monte_visit_t) num_visits;
+
+#ifdef MONTE_ENABLE_SHARED
+	// Held while expanding
+	MONTE_ATOMIC(bool) locked;
+#endif
 };
 
+#ifdef MONTE_ENABLE_SHARED
+#define MONTE_SHARED_READY 0x6d6f6e74
+
+// At the start of the shared memory
+typedef struct {
+	MONTE_ATOMIC(uint32_t) ready;
+	size_t size;
+	// Offset of the first free byte
+	MONTE_ATOMIC(size_t) head;
+	monte_link_t root;
+} monte_shared_header_t;
+#endif
+
 struct monte_s {
 	monte_config_t config;
 	monte_node_t* node_pool;
+	monte_move_list_t* move_list_pool[MONTE_MOVE_LIST_NUM_CLASSES];
+
+	// Moves of the node being expanded
+	monte_untried_move_t* tmp_moves;
+	monte_index_t tmp_moves_capacity;
 
 	monte_state_t* current_state;
 	monte_state_t* tmp_state;
 	monte_state_t* tmp_state2;
 	monte_state_info_t* tmp_state_info;
 	monte_state_info_t* tmp_state_info2;
+	float* tmp_values;
 	monte_node_t* root;
+
+	uintptr_t base;
+#ifdef MONTE_ENABLE_SHARED
+	monte_shared_header_t* shared;
+#endif
+
+#ifdef MONTE_BATCH_SIZE
+	monte_state_t* batch_states[MONTE_BATCH_SIZE];
+	monte_node_t* batch_nodes[MONTE_BATCH_SIZE];
+	float* batch_values;
+#endif
+
+#ifdef MONTE_ENABLE_STEP
+	// Moving average of the time taken by an iteration
+	uint64_t step_ns_per_iteration;
+#endif
+
+#ifdef MONTE_ENABLE_TRACE
+	monte_trace_fn_t trace_fn;
+	void* trace_userdata;
+	uint8_t* trace_buffer;
+	size_t trace_size;
+#endif
+
+#ifdef MONTE_ENABLE_COMPACTION
+	// The tree is compacted into these in turn. The one it was compacted out
+	// of last holds no nodes, live or free, so the next compaction reuses it.
+	monte_node_t* compact_blocks[2];
+	size_t compact_block_capacity[2];
+	int compact_block;
+#endif
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+	// Root children still in the running, 0 when not halving
+	monte_halving_candidate_t* halving_candidates;
+	monte_index_t halving_capacity;
+	monte_index_t num_halving_candidates;
+	monte_index_t next_halving_candidate;
+	monte_index_t num_halving_rounds_left;
+	monte_index_t halving_round_iterations_left;
+	monte_index_t halving_iterations_left;
+#endif
 };
 
 typedef void (*monte_submit_move_fn_t)(void* userdata, const monte_move_t* move);
@@ -165,14 +728,12 @@ struct monte_iterator_s {
 };
 
 typedef struct {
+	monte_t* monte;
 	monte_index_t num_moves;
-	monte_move_t move;
-	monte_rng_state_t* rng_state;
-	monte_node_t* in_node;
-	monte_node_t** out_node;
+	// To move in current_state
+	monte_player_id_t player;
 
-	monte_move_t end_move;
-	bool found_end_move;
+	monte_index_t end_move_index;
 	const monte_state_t* current_state;
 	monte_state_t* tmp_state;
 	monte_state_info_t* tmp_state_info;
@@ -184,58 +745,219 @@ typedef struct {
 	monte_rng_state_t* rng_state;
 } monte_iterator_for_simulation_t;
 
+#if defined(MONTE_ENABLE_SCHEDULER) || defined(MONTE_ENABLE_STEP)
+static inline uint64_t
+monte_clock_ns(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+static inline void*
+monte_deref(const monte_t* monte, monte_ref_t ref) {
+	return ref != 0 ? (void*)(monte->base + ref) : NULL;
+}
+
+static inline monte_ref_t
+monte_ref(const monte_t* monte, const void* ptr) {
+	return ptr != NULL ? (uintptr_t)ptr - monte->base : 0;
+}
+
+static inline monte_node_t*
+monte_load_node(const monte_t* monte, const monte_link_t* link) {
+	return (monte_node_t*)monte_deref(monte, MONTE_LOAD(link));
+}
+
+static inline monte_node_t*
+monte_load_node_acquire(const monte_t* monte, const monte_link_t* link) {
+	return (monte_node_t*)monte_deref(monte, MONTE_LOAD_ACQUIRE(link));
+}
+
+static inline void
+monte_store_node(const monte_t* monte, monte_link_t* link, const monte_node_t* node) {
+	MONTE_STORE(link, monte_ref(monte, node));
+}
+
+static inline void
+monte_publish_node(const monte_t* monte, monte_link_t* link, const monte_node_t* node) {
+	MONTE_PUBLISH(link, monte_ref(monte, node));
+}
+
+static inline monte_node_t*
+monte_parent(const monte_t* monte, const monte_node_t* node) {
+	return (monte_node_t*)monte_deref(monte, node->parent);
+}
+
+#ifdef MONTE_ENABLE_SHARED
+// Also works for float values, which have no fetch_add
+static inline void
+monte_atomic_add_value(MONTE_ATOMIC(monte_value_t)* ptr, monte_value_t value) {
+	monte_value_t expected = MONTE_LOAD(ptr);
+	while (!atomic_compare_exchange_weak_explicit(
+		ptr, &expected, expected + value, memory_order_relaxed, memory_order_relaxed
+	)) {}
+}
+
+// Return NULL once the shared memory is full
+static inline void*
+monte_shared_alloc(monte_t* monte, size_t size, size_t alignment) {
+	monte_shared_header_t* shared = monte->shared;
+	size = (size + alignment - 1) & ~(alignment - 1);
+	size_t offset = atomic_fetch_add_explicit(&shared->head, size, memory_order_relaxed);
+	offset = (offset + alignment - 1) & ~(alignment - 1);
+	if (offset + size > shared->size) { return NULL; }
+
+	return (void*)(monte->base + offset);
+}
+#endif
+
+static inline monte_value_t
+monte_value_from_reward(float reward) {
+	float scaled = reward * (float)MONTE_VALUE_SCALE;
+	// Constant, so only one branch is compiled in
+	bool is_integer = (monte_value_t)0.5f == 0;
+	return is_integer ? (monte_value_t)lrintf(scaled) : (monte_value_t)scaled;
+}
+
+// Visits at which a node is rescaled, see MONTE_VALUE_TYPE. Constant.
+static inline monte_visit_t
+monte_visit_limit(void) {
+	bool is_integer = (monte_value_t)0.5f == 0;
+	if (is_integer) { return MONTE_VISIT_MAX; }
+
+	int mantissa_digits = sizeof(monte_value_t) == sizeof(float) ? FLT_MANT_DIG : DBL_MANT_DIG;
+	double max_visits = (double)((uint64_t)1 << mantissa_digits) / (double)MONTE_VALUE_SCALE;
+	return max_visits < (double)MONTE_VISIT_MAX ? (monte_visit_t)max_visits : MONTE_VISIT_MAX;
+}
+
+static inline float
+monte_win_rate(monte_value_t value, monte_visit_t num_visits) {
+	return (float)value / ((float)MONTE_VALUE_SCALE * (float)num_visits);
+}
+
+static inline void*
+monte_alloc_tree_memory(monte_t* monte, size_t size, size_t alignment) {
+#ifdef MONTE_ENABLE_SHARED
+	if (monte->shared != NULL) {
+		return monte_shared_alloc(monte, size, alignment);
+	}
+#endif
+
+	return monte_user_alloc(size, alignment, monte->config.allocator_ctx);
+}
+
 static inline monte_node_t*
 monte_alloc_node(monte_t* monte) {
 	monte_node_t* node = monte->node_pool;
 	if (node != NULL) {
-		monte->node_pool = node->next;
+		monte->node_pool = monte_load_node(monte, &node->next);
 		return node;
 	} else {
-		return monte_user_alloc(
-			sizeof(monte_node_t),
-			_Alignof(monte_node_t),
-			monte->config.allocator_ctx
-		);
+		return (monte_node_t*)monte_alloc_tree_memory(monte, sizeof(monte_node_t), MONTE_ALIGNOF(monte_node_t));
+	}
+}
+
+static inline monte_move_list_t*
+monte_alloc_move_list(monte_t* monte, monte_index_t num_moves) {
+	int size_class = 0;
+	while (((monte_index_t)MONTE_MOVE_LIST_MIN_CAPACITY << size_class) < num_moves) {
+		++size_class;
+	}
+
+	monte_move_list_t* list = monte->move_list_pool[size_class];
+	if (list != NULL) {
+		monte->move_list_pool[size_class] = list->next;
+		return list;
 	}
+
+	list = (monte_move_list_t*)monte_alloc_tree_memory(
+		monte,
+		MONTE_MOVE_LIST_HEADER_SIZE
+			+ sizeof(monte_move_t) * ((size_t)MONTE_MOVE_LIST_MIN_CAPACITY << size_class),
+		MONTE_MOVE_LIST_ALIGNMENT
+	);
+	if (list != NULL) { list->size_class = size_class; }
+	return list;
+}
+
+static inline monte_move_t*
+monte_move_list_moves(monte_move_list_t* list) {
+	return (monte_move_t*)((char*)list + MONTE_MOVE_LIST_HEADER_SIZE);
 }
 
 static inline void
-monte_free_node(monte_node_t* node, monte_t* monte) {
-	node->next = monte->node_pool;
-	monte->node_pool = node;
+monte_free_move_list(monte_move_list_t* list, monte_t* monte) {
+	list->next = monte->move_list_pool[list->size_class];
+	monte->move_list_pool[list->size_class] = list;
 }
 
-static inline monte_node_t**
-monte_find_node(monte_node_t** root, const monte_move_t* move) {
-	monte_node_t** node_itr = root;
-	monte_hash_t hash_itr = monte_user_hash_move(move);
-	for (
-		;
-		*node_itr != NULL;
-		hash_itr >>= MONTE_HAMT_NUM_BITS
+// Give a buffer which is no longer needed to the move list pool, as the
+// largest list it can hold
+static inline void
+monte_recycle_buffer(monte_t* monte, void* buffer, size_t size) {
+#ifdef MONTE_ENABLE_SHARED
+	// Lists of a shared tree must be in the shared memory
+	if (monte->shared != NULL) { return; }
+#endif
+
+	int size_class = -1;
+	while (
+		size_class + 1 < MONTE_MOVE_LIST_NUM_CLASSES
+		&& MONTE_MOVE_LIST_HEADER_SIZE
+			+ sizeof(monte_move_t) * ((size_t)MONTE_MOVE_LIST_MIN_CAPACITY << (size_class + 1))
+			<= size
 	) {
-		monte_node_t* node = *node_itr;
-		if (monte_user_moves_equal(&node->move, move)) {
-			return node_itr;
-		}
-		node_itr = &node->hamt[hash_itr & MONTE_HAMT_MASK];
+		++size_class;
+	}
+	if (size_class < 0) { return; }
+
+	monte_move_list_t* list = (monte_move_list_t*)buffer;
+	list->size_class = size_class;
+	monte_free_move_list(list, monte);
+}
+
+static inline void
+monte_free_node(monte_node_t* node, monte_t* monte) {
+	if (node->untried_moves != 0) {
+		monte_free_move_list((monte_move_list_t*)monte_deref(monte, node->untried_moves), monte);
 	}
 
-	return node_itr;
+	monte_store_node(monte, &node->next, monte->node_pool);
+	monte->node_pool = node;
 }
 
+#ifndef MONTE_MOVE_CURSOR_TYPE
 static inline void
 monte_iterate_moves(const monte_state_t* state, monte_submit_move_fn_t fn, void* userdata) {
-	monte_iterator_t itr = {
-		.fn = fn,
-		.userdata = userdata,
-	};
+	monte_iterator_t itr;
+	itr.fn = fn;
+	itr.userdata = userdata;
 	monte_user_iterate_moves(state, &itr);
 }
+#endif
+
+static inline void
+monte_apply_and_inspect(monte_state_t* state, const monte_move_t* move, monte_state_info_t* info) {
+#ifdef MONTE_ENABLE_APPLY_AND_INSPECT
+	monte_user_apply_and_inspect(state, move, info);
+#else
+	monte_user_apply_move(state, move);
+	monte_user_inspect_state(state, info);
+#endif
+}
 
 static inline void
 monte_submit_move_for_expansion(void* userdata, const monte_move_t* move) {
-	monte_iterator_for_expansion_t* itr = userdata;
+	monte_iterator_for_expansion_t* itr = (monte_iterator_for_expansion_t*)userdata;
+	monte_t* monte = itr->monte;
+
+#ifdef MONTE_ENABLE_CANONICALIZATION
+	// Symmetric moves lead to equivalent subtrees, only search one of them
+	monte_move_t canonical_move = *move;
+	monte_user_canonicalize(itr->current_state, &canonical_move);
+	if (!monte_user_moves_equal(&canonical_move, move)) { return; }
+#endif
 
 	// Prioritize ending move
 	//
@@ -244,60 +966,125 @@ monte_submit_move_for_expansion(void* userdata, const monte_move_t* move) {
 	// > This check at the leaf node must be performed because otherwise it
 	// > could take many simulations before the child leading to a mate-in-one
 	// > is selected and the node is proven.
-	if (itr->in_node->num_visits == 1 && !itr->found_end_move) {
+	if (itr->end_move_index < 0) {
+#ifndef MONTE_ENABLE_UNDO
 		monte_user_copy_state(itr->tmp_state, itr->current_state);
-		monte_user_inspect_state(itr->tmp_state, itr->tmp_state_info);
-		monte_player_id_t player = itr->tmp_state_info->current_player;
-		monte_user_apply_move(itr->tmp_state, move);
-		monte_user_inspect_state(itr->tmp_state, itr->tmp_state_info);
+#endif
+		monte_apply_and_inspect(itr->tmp_state, move, itr->tmp_state_info);
+#ifdef MONTE_ENABLE_UNDO
+		monte_user_undo_move(itr->tmp_state, move);
+#endif
 
 		if (
 			itr->tmp_state_info->current_player == MONTE_INVALID_PLAYER
-			&& itr->tmp_state_info->scores[player] > 0
+			&& itr->tmp_state_info->scores[itr->player] > 0
 		) {
-			itr->end_move = *move;
-			itr->found_end_move = true;
+			itr->end_move_index = itr->num_moves;
 		}
 	}
 
-	monte_node_t** move_ptr = monte_find_node(&itr->in_node->children, move);
-	if (*move_ptr != NULL) { return; }
-
-	bool move_chosen = false;
-	if (itr->num_moves == 0) {
-		itr->move = *move;
-		++itr->num_moves;
-		move_chosen = true;
-	} else {
-		monte_index_t num_moves = ++itr->num_moves;
-		float random_number = monte_user_rng_next(itr->rng_state);
-		if ((random_number * (float)num_moves) < 1.f) {
-			itr->move = *move;
-			move_chosen = true;
-		}
+	if (itr->num_moves == monte->tmp_moves_capacity) {
+		monte_index_t capacity = monte->tmp_moves_capacity * 2;
+		monte_untried_move_t* moves = (monte_untried_move_t*)monte_user_alloc(
+			sizeof(monte_untried_move_t) * capacity,
+			MONTE_TMP_MOVES_ALIGNMENT,
+			monte->config.allocator_ctx
+		);
+		memcpy(moves, monte->tmp_moves, sizeof(monte_untried_move_t) * itr->num_moves);
+		monte_recycle_buffer(
+			monte, monte->tmp_moves, sizeof(monte_untried_move_t) * monte->tmp_moves_capacity
+		);
+		monte->tmp_moves = moves;
+		monte->tmp_moves_capacity = capacity;
 	}
 
-	if (move_chosen) {
-		itr->out_node = move_ptr;
-	}
+	monte_untried_move_t* untried_move = &monte->tmp_moves[itr->num_moves++];
+	untried_move->move = *move;
+#ifdef MONTE_ENABLE_MOVE_PRIORITY
+	untried_move->priority = monte_user_move_priority(itr->current_state, move);
+#endif
 }
 
-static inline monte_iterator_for_expansion_t
-monte_iterate_moves_for_expansion(const monte_state_t* state, monte_node_t* node, monte_t* monte) {
-	monte_iterator_for_expansion_t itr = {
-		.rng_state = &monte->config.rng_state,
-		.in_node = node,
-		.current_state = state,
-		.tmp_state = monte->tmp_state2,
-		.tmp_state_info = monte->tmp_state_info2,
-	};
+#ifdef MONTE_ENABLE_MOVE_PRIORITY
+static int
+monte_compare_untried_moves(const void* lhs, const void* rhs) {
+	float lhs_priority = ((const monte_untried_move_t*)lhs)->priority;
+	float rhs_priority = ((const monte_untried_move_t*)rhs)->priority;
+	return (lhs_priority > rhs_priority) - (lhs_priority < rhs_priority);
+}
+#endif
+
+// Collect the moves of a node being expanded for the first time into its
+// untried list: shuffled, sorted by ascending priority if enabled, with a
+// game ending move on top.
+static inline void
+monte_init_untried_moves(monte_t* monte, const monte_state_t* state, monte_node_t* node) {
+	monte_iterator_for_expansion_t itr;
+	itr.monte = monte;
+	itr.num_moves = 0;
+	itr.player = node->current_player;
+	itr.end_move_index = -1;
+	itr.current_state = state;
+	itr.tmp_state = monte->tmp_state2;
+	itr.tmp_state_info = monte->tmp_state_info2;
+#ifdef MONTE_ENABLE_UNDO
+	// Copy once, every tried move is undone
+	monte_user_copy_state(itr.tmp_state, state);
+#endif
+#ifdef MONTE_MOVE_CURSOR_TYPE
+	monte_move_t move;
+	MONTE_FOREACH_MOVE(state, move) {
+		monte_submit_move_for_expansion(&itr, &move);
+	}
+#else
 	monte_iterate_moves(state, monte_submit_move_for_expansion, &itr);
-	return itr;
+#endif
+
+	monte_index_t num_moves = itr.num_moves;
+	monte_move_list_t* list = num_moves > 0 ? monte_alloc_move_list(monte, num_moves) : NULL;
+	if (list == NULL) {
+		// Out of memory in a shared tree, leave the node as a leaf
+		MONTE_STORE(&node->num_moves_left, 0);
+		return;
+	}
+
+	monte_untried_move_t* moves = monte->tmp_moves;
+	monte_untried_move_t end_move;
+	monte_index_t num_shuffled = num_moves;
+	if (itr.end_move_index >= 0) {
+		end_move = moves[itr.end_move_index];
+		moves[itr.end_move_index] = moves[--num_shuffled];
+	}
+
+	for (monte_index_t i = num_shuffled - 1; i > 0; --i) {
+		float random_number = monte_user_rng_next(&monte->config.rng_state);
+		monte_index_t j = (monte_index_t)(random_number * (float)(i + 1));
+		if (j > i) { j = i; }
+
+		monte_untried_move_t tmp = moves[i];
+		moves[i] = moves[j];
+		moves[j] = tmp;
+	}
+#ifdef MONTE_ENABLE_MOVE_PRIORITY
+	// Highest priority is expanded first, ties in random order
+	qsort(moves, num_shuffled, sizeof(monte_untried_move_t), monte_compare_untried_moves);
+#endif
+
+	if (itr.end_move_index >= 0) {
+		moves[num_shuffled] = end_move;
+	}
+
+	monte_move_t* list_moves = monte_move_list_moves(list);
+	for (monte_index_t i = 0; i < num_moves; ++i) {
+		list_moves[i] = moves[i].move;
+	}
+	node->untried_moves = monte_ref(monte, list);
+	MONTE_STORE(&node->num_moves_left, num_moves);
 }
 
 static inline void
 monte_submit_move_for_simulation(void* userdata, const monte_move_t* move) {
-	monte_iterator_for_simulation_t* itr = userdata;
+	monte_iterator_for_simulation_t* itr = (monte_iterator_for_simulation_t*)userdata;
 
 	if (itr->num_moves == 0) {
 		itr->move = *move;
@@ -313,198 +1100,778 @@ monte_submit_move_for_simulation(void* userdata, const monte_move_t* move) {
 
 static inline monte_move_t
 monte_pick_move_for_simulation(const monte_state_t* state, monte_t* monte) {
-	monte_iterator_for_simulation_t itr = {
-		.rng_state = &monte->config.rng_state,
-	};
+	monte_iterator_for_simulation_t itr;
+	itr.num_moves = 0;
+	// Zero if there are no moves
+	memset((void*)&itr.move, 0, sizeof(itr.move));
+	itr.rng_state = &monte->config.rng_state;
+#ifdef MONTE_MOVE_CURSOR_TYPE
+	monte_move_t move;
+	MONTE_FOREACH_MOVE(state, move) {
+		monte_submit_move_for_simulation(&itr, &move);
+	}
+#else
 	monte_iterate_moves(state, monte_submit_move_for_simulation, &itr);
+#endif
 	return itr.move;
 }
 
-monte_t*
-monte_create(const monte_state_t* initial_state, monte_config_t config) {
-	monte_t* monte = monte_user_alloc(sizeof(monte_t), _Alignof(monte_t), config.allocator_ctx);
-	*monte = (monte_t){
-		.config = config,
-		.current_state = monte_user_create_state(&config.game_config),
-		.tmp_state = monte_user_create_state(&config.game_config),
-		.tmp_state2 = monte_user_create_state(&config.game_config),
-		.tmp_state_info = monte_user_alloc(
-			sizeof(monte_state_info_t) + sizeof(monte_index_t) * config.num_players,
-			_Alignof(monte_state_info_t),
-			config.allocator_ctx
-		),
-		.tmp_state_info2 = monte_user_alloc(
-			sizeof(monte_state_info_t) + sizeof(monte_index_t) * config.num_players,
-			_Alignof(monte_state_info_t),
-			config.allocator_ctx
-		),
-	};
-
-	monte_node_t* root = monte_alloc_node(monte);
-	*root = (monte_node_t) {
-		.num_moves_left = -1,
-	};
-	monte->root = root;
+static inline monte_move_t
+monte_pick_rollout_move(const monte_state_t* state, monte_t* monte) {
+#ifdef MONTE_ENABLE_ROLLOUT_POLICY
+	monte_move_t move;
+	if (monte_user_pick_rollout_move(state, &monte->config.rng_state, &move)) {
+		return move;
+	}
+#endif
 
-	monte_user_copy_state(monte->current_state, initial_state);
+	return monte_pick_move_for_simulation(state, monte);
+}
+
+// Everything but the move of a node which is not linked yet
+static inline void
+monte_init_node(monte_node_t* node, monte_ref_t parent, monte_player_id_t current_player) {
+	MONTE_STORE(&node->num_moves_left, -1);  // Unknown
+	node->untried_moves = 0;
+	MONTE_STORE(&node->num_children, 0);
+	MONTE_STORE(&node->next, 0);
+	MONTE_STORE(&node->children, 0);
+	MONTE_STORE(&node->instant_winner, MONTE_INVALID_PLAYER);
+	MONTE_STORE(&node->proven_winner, MONTE_INVALID_PLAYER);
+	MONTE_STORE(&node->num_proven_children, 0);
+	node->parent = parent;
+	node->current_player = current_player;
+	MONTE_STORE(&node->value, 0);
+	MONTE_STORE(&node->num_visits, 0);
+#ifdef MONTE_ENABLE_SHARED
+	MONTE_STORE(&node->locked, false);
+#endif
+}
+
+// Return NULL if out of memory
+static monte_node_t*
+monte_alloc_root(monte_t* monte, monte_player_id_t current_player) {
+	monte_node_t* root = monte_alloc_node(monte);
+	if (root == NULL) { return NULL; }
+
+	monte_init_node(root, 0, current_player);
+	return root;
+}
 
+// Initialize a root for current_state, return NULL if out of memory
+static monte_node_t*
+monte_create_root(monte_t* monte) {
 	monte_user_inspect_state(monte->current_state, monte->tmp_state_info);
-	root->current_player = monte->tmp_state_info->current_player;
+	return monte_alloc_root(monte, monte->tmp_state_info->current_player);
+}
+
+static monte_state_info_t*
+monte_create_state_info(const monte_config_t* config) {
+	monte_state_info_t* info = (monte_state_info_t*)monte_user_alloc(
+		sizeof(monte_state_info_t), MONTE_ALIGNOF(monte_state_info_t), config->allocator_ctx
+	);
+	info->scores = (monte_index_t*)monte_user_alloc(
+		sizeof(monte_index_t) * config->num_players,
+		MONTE_ALIGNOF(monte_index_t),
+		config->allocator_ctx
+	);
+	return info;
+}
+
+// Everything but the tree
+static monte_t*
+monte_create_searcher(const monte_state_t* initial_state, monte_config_t config) {
+	monte_t* monte = (monte_t*)monte_user_alloc(
+		sizeof(monte_t), MONTE_ALIGNOF(monte_t), config.allocator_ctx
+	);
+	memset(monte, 0, sizeof(monte_t));
+	monte->config = config;
+	monte->tmp_moves = (monte_untried_move_t*)monte_user_alloc(
+		sizeof(monte_untried_move_t) * MONTE_MOVE_LIST_MIN_CAPACITY,
+		MONTE_TMP_MOVES_ALIGNMENT,
+		config.allocator_ctx
+	);
+	monte->tmp_moves_capacity = MONTE_MOVE_LIST_MIN_CAPACITY;
+	monte->current_state = monte_user_create_state(&config.game_config);
+	monte->tmp_state = monte_user_create_state(&config.game_config);
+	monte->tmp_state2 = monte_user_create_state(&config.game_config);
+	monte->tmp_state_info = monte_create_state_info(&config);
+	monte->tmp_state_info2 = monte_create_state_info(&config);
+	monte->tmp_values = (float*)monte_user_alloc(
+		sizeof(float) * config.num_players,
+		MONTE_ALIGNOF(float),
+		config.allocator_ctx
+	);
+
+	monte_user_copy_state(monte->current_state, initial_state);
+#ifdef MONTE_ENABLE_UNDO
+	monte_user_copy_state(monte->tmp_state, initial_state);
+#endif
+
+#ifdef MONTE_BATCH_SIZE
+	for (monte_index_t i = 0; i < MONTE_BATCH_SIZE; ++i) {
+		monte->batch_states[i] = monte_user_create_state(&config.game_config);
+	}
+	monte->batch_values = (float*)monte_user_alloc(
+		sizeof(float) * config.num_players * MONTE_BATCH_SIZE,
+		MONTE_ALIGNOF(float),
+		config.allocator_ctx
+	);
+#endif
 
 	return monte;
 }
 
-void
-monte_iterate(monte_t* monte) {
-	monte_state_t* state = monte->tmp_state;
-	monte_user_copy_state(state, monte->current_state);
+monte_t*
+monte_create(const monte_state_t* initial_state, monte_config_t config) {
+	monte_t* monte = monte_create_searcher(initial_state, config);
+	monte->root = monte_create_root(monte);
+	return monte;
+}
 
-	// Selection
-	monte_node_t* node = monte->root;
-	{
-		float c = monte->config.exploration_param;
-		while (node->num_moves_left == 0) {
-			monte_player_id_t player = node->current_player;
-			float chosen_uct_score = -INFINITY;
-			monte_node_t* chosen_node = NULL;
-			float parent_log_n = logf((float)node->num_visits);
-			for (
-				monte_node_t* itr = node->children;
-				itr != NULL;
-				itr = itr->next
-			) {
-				if (itr->instant_winner == player) {
-					chosen_node = itr;
-					break;
-				}
+#ifdef MONTE_ENABLE_SHARED
 
-				if (itr->instant_winner != MONTE_INVALID_PLAYER && itr->instant_winner != player) {
-					continue;
-				}
+monte_t*
+monte_create_shared(
+	const monte_state_t* initial_state,
+	monte_config_t config,
+	void* memory,
+	size_t size,
+	bool initialize
+) {
+	monte_shared_header_t* shared = memory;
+	if (!initialize && atomic_load_explicit(&shared->ready, memory_order_acquire) != MONTE_SHARED_READY) {
+		return NULL;
+	}
 
-				float win_rate = (float)itr->num_wins / (float)itr->num_visits;
-				float explore_rate = c * sqrtf(parent_log_n / (float)itr->num_visits);
-				float uct_score = win_rate + explore_rate;
-				if (uct_score > chosen_uct_score) {
-					chosen_uct_score = uct_score;
-					chosen_node = itr;
-				}
-			}
+	monte_t* monte = monte_create_searcher(initial_state, config);
+	monte->base = (uintptr_t)memory;
+	monte->shared = shared;
+
+	if (initialize) {
+		shared->size = size;
+		atomic_init(&shared->head, sizeof(monte_shared_header_t));
+		atomic_init(&shared->root, monte_ref(monte, monte_create_root(monte)));
+		atomic_store_explicit(&shared->ready, MONTE_SHARED_READY, memory_order_release);
+	}
+
+	monte->root = monte_load_node_acquire(monte, &shared->root);
+	return monte;
+}
+
+#endif
+
+static inline bool
+monte_node_is_widened(monte_t* monte, const monte_node_t* node) {
+	float coefficient = MONTE_CONFIG(monte, widening_coefficient);
+	monte_index_t num_children = MONTE_LOAD(&node->num_children);
+	if (coefficient <= 0.f || num_children == 0) { return false; }
+
+	float exponent = MONTE_CONFIG(monte, widening_exponent);
+	float max_children = ceilf(coefficient * powf((float)MONTE_LOAD(&node->num_visits), exponent));
+	return (float)num_children >= max_children;
+}
+
+static inline void
+monte_set_instant_winner(monte_t* monte, monte_node_t* node, monte_player_id_t winner) {
+	monte_player_id_t expected = MONTE_INVALID_PLAYER;
+	if (!MONTE_CAS(&node->instant_winner, &expected, winner)) { return; }
+
+	// Keep track of proven children so that backpropagation does not have to
+	// scan them
+	monte_node_t* parent = monte_parent(monte, node);
+	if (parent == NULL) { return; }
+
+	MONTE_ADD(&parent->num_proven_children, 1);
+	expected = MONTE_INVALID_PLAYER;
+	if (!MONTE_CAS(&parent->proven_winner, &expected, winner) && expected != winner) {
+		MONTE_STORE(&parent->proven_winner, MONTE_MIXED_PLAYER);
+	}
+}
+
+// Only one searcher of a shared tree may expand a node at a time
+static inline bool
+monte_lock_node(monte_node_t* node) {
+#ifdef MONTE_ENABLE_SHARED
+	return !atomic_exchange_explicit(&node->locked, true, memory_order_acquire);
+#else
+	(void)node;
+	return true;
+#endif
+}
+
+static inline void
+monte_unlock_node(monte_node_t* node) {
+#ifdef MONTE_ENABLE_SHARED
+	atomic_store_explicit(&node->locked, false, memory_order_release);
+#else
+	(void)node;
+#endif
+}
+
+#ifdef MONTE_ENABLE_TRACE
+
+static inline void
+monte_trace_flush(monte_t* monte) {
+	if (monte->trace_size > 0) {
+		monte->trace_fn(monte->trace_userdata, monte->trace_buffer, monte->trace_size);
+		monte->trace_size = 0;
+	}
+}
+
+static inline void
+monte_trace_put_byte(monte_t* monte, uint8_t byte) {
+	if (monte->trace_size == MONTE_TRACE_BUFFER_SIZE) {
+		monte_trace_flush(monte);
+	}
+	monte->trace_buffer[monte->trace_size++] = byte;
+}
+
+static inline void
+monte_trace_put_varint(monte_t* monte, uint64_t value) {
+	for (; value >= 0x80; value >>= 7) {
+		monte_trace_put_byte(monte, (uint8_t)(value | 0x80));
+	}
+	monte_trace_put_byte(monte, (uint8_t)value);
+}
+
+static inline void
+monte_trace_put_float(monte_t* monte, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	for (int i = 0; i < 4; ++i) {
+		monte_trace_put_byte(monte, (uint8_t)(bits >> (i * 8)));
+	}
+}
+
+static inline void
+monte_trace_put_player(monte_t* monte, monte_player_id_t player) {
+	monte_trace_put_byte(monte, (uint8_t)(player + 1));
+}
+
+static monte_index_t
+monte_child_position(const monte_t* monte, const monte_node_t* parent, const monte_node_t* child) {
+	monte_index_t position = 0;
+	for (
+		monte_node_t* itr = monte_load_node(monte, &parent->children);
+		itr != child;
+		itr = monte_load_node(monte, &itr->next)
+	) {
+		++position;
+	}
+	return position;
+}
+
+static void
+monte_trace_expansion(
+	monte_t* monte,
+	bool first_expansion,
+	monte_index_t num_moves,
+	const monte_node_t* new_node
+) {
+	monte_trace_put_byte(
+		monte,
+		(first_expansion ? MONTE_TRACE_FIRST_EXPANSION : 0)
+		| (new_node != NULL ? MONTE_TRACE_EXPANDED : 0)
+	);
+	if (first_expansion) {
+		monte_trace_put_varint(monte, (uint64_t)num_moves);
+	}
+	if (new_node != NULL) {
+		monte_trace_put_player(monte, new_node->current_player);
+	}
+}
+
+static void
+monte_trace_backup(monte_t* monte, const float* values) {
+	monte_trace_put_byte(monte, MONTE_TRACE_BACKUP);
+	for (monte_player_id_t i = 0; i < MONTE_CONFIG(monte, num_players); ++i) {
+		monte_trace_put_float(monte, values[i]);
+	}
+}
+
+#endif
+
+// Initialize a new node as a child of a locked node. It goes second in the
+// list, so that the first child does not change under concurrent readers.
+static inline void
+monte_link_child(
+	monte_t* monte,
+	monte_node_t* parent,
+	monte_node_t* new_node,
+	const monte_move_t* move,
+	monte_player_id_t current_player
+) {
+	monte_node_t* head = monte_load_node(monte, &parent->children);
+	monte_init_node(new_node, monte_ref(monte, parent), current_player);
+	new_node->move = *move;
+
+	// Only link the node once it is fully initialized
+	if (head != NULL) {
+		monte_store_node(monte, &new_node->next, monte_load_node(monte, &head->next));
+		monte_publish_node(monte, &head->next, new_node);
+	} else {
+		monte_publish_node(monte, &parent->children, new_node);
+	}
+	MONTE_ADD(&parent->num_children, 1);
+}
 
-			if (chosen_node == NULL) { break; }
+// Turn the next untried move of a locked node into a child and play it on
+// `state`. Return NULL if there is none left or no memory for it.
+static inline monte_node_t*
+monte_add_child(
+	monte_t* monte,
+	monte_node_t* parent,
+	monte_state_t* state,
+	monte_state_info_t* state_info
+) {
+	bool first_expansion = MONTE_LOAD(&parent->num_moves_left) < 0;
+	if (first_expansion) {
+		monte_init_untried_moves(monte, state, parent);
+	}
 
-			monte_user_apply_move(state, &chosen_node->move);
-			node = chosen_node;
+	monte_index_t num_moves_left = MONTE_LOAD(&parent->num_moves_left);
+	monte_node_t* new_node = num_moves_left > 0 ? monte_alloc_node(monte) : NULL;
+	if (new_node == NULL) {
+#ifdef MONTE_ENABLE_TRACE
+		if (monte->trace_fn != NULL) {
+			monte_trace_expansion(monte, first_expansion, num_moves_left, NULL);
 		}
+#endif
+		return NULL;
 	}
 
-	// Expansion
-	monte_state_info_t* state_info = monte->tmp_state_info;
-	monte_user_inspect_state(state, state_info);
-	if (state_info->current_player != MONTE_INVALID_PLAYER) {
-		monte_iterator_for_expansion_t itr = monte_iterate_moves_for_expansion(state, node, monte);
-		node->num_moves_left = itr.num_moves - 1;
-
-		if (itr.num_moves > 0) {
-			monte_node_t* head = node->children;
-			monte_node_t* new_node = *itr.out_node = monte_alloc_node(monte);
-
-			monte_move_t move = itr.found_end_move ? itr.end_move : itr.move;
-
-			monte_user_apply_move(state, &move);
-			monte_user_inspect_state(state, state_info);
-
-			*new_node = (monte_node_t) {
-				.move = move,
-				.num_moves_left = -1,  // Unknown
-				.parent = node,
-				.current_player = state_info->current_player,
-				.instant_winner = MONTE_INVALID_PLAYER,
-			};
-
-			if (head != NULL) {
-				new_node->next = head->next;
-				head->next = new_node;
-			}
+	monte_move_list_t* untried_moves =
+		(monte_move_list_t*)monte_deref(monte, parent->untried_moves);
+	monte_move_t move = monte_move_list_moves(untried_moves)[--num_moves_left];
+	if (num_moves_left == 0) {
+		monte_free_move_list(untried_moves, monte);
+		parent->untried_moves = 0;
+	}
+
+	monte_apply_and_inspect(state, &move, state_info);
+
+	monte_link_child(monte, parent, new_node, &move, state_info->current_player);
+	MONTE_STORE(&parent->num_moves_left, num_moves_left);
+#ifdef MONTE_ENABLE_TRACE
+	if (monte->trace_fn != NULL) {
+		monte_trace_expansion(monte, first_expansion, num_moves_left + 1, new_node);
+	}
+#endif
+
+	return new_node;
+}
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+
+static inline float
+monte_halving_score(
+	const monte_t* monte,
+	const monte_halving_candidate_t* candidate,
+	monte_visit_t max_visits
+) {
+	const monte_node_t* node = candidate->node;
+	monte_player_id_t instant_winner = MONTE_LOAD(&node->instant_winner);
+	if (instant_winner == monte->root->current_player) { return INFINITY; }
+	if (instant_winner != MONTE_INVALID_PLAYER) { return -INFINITY; }
+
+	monte_visit_t num_visits = MONTE_LOAD(&node->num_visits);
+	float win_rate = num_visits > 0
+		? monte_win_rate(MONTE_LOAD(&node->value), num_visits)
+		: 0.f;
+	if (monte->config.halving_gumbel_scale > 0.f) {
+		return candidate->noise
+			+ (MONTE_HALVING_C_VISIT + (float)max_visits) * MONTE_HALVING_C_SCALE * win_rate;
+	} else {
+		return win_rate;
+	}
+}
+
+static int
+monte_compare_halving_candidates(const void* lhs, const void* rhs) {
+	float lhs_score = ((const monte_halving_candidate_t*)lhs)->score;
+	float rhs_score = ((const monte_halving_candidate_t*)rhs)->score;
+	return (lhs_score < rhs_score) - (lhs_score > rhs_score);
+}
+
+// Best first
+static inline void
+monte_rank_halving_candidates(monte_t* monte) {
+	monte_halving_candidate_t* candidates = monte->halving_candidates;
+	monte_index_t num_candidates = monte->num_halving_candidates;
+	monte_visit_t max_visits = 0;
+	for (monte_index_t i = 0; i < num_candidates; ++i) {
+		monte_visit_t num_visits = MONTE_LOAD(&candidates[i].node->num_visits);
+		if (num_visits > max_visits) { max_visits = num_visits; }
+	}
+
+	for (monte_index_t i = 0; i < num_candidates; ++i) {
+		candidates[i].score = monte_halving_score(monte, &candidates[i], max_visits);
+	}
+	qsort(
+		candidates, num_candidates, sizeof(monte_halving_candidate_t),
+		monte_compare_halving_candidates
+	);
+}
+
+static inline void
+monte_start_halving_round(monte_t* monte) {
+	monte->halving_round_iterations_left =
+		monte->halving_iterations_left / monte->num_halving_rounds_left;
+	monte->next_halving_candidate = 0;
+}
+
+// Root child for the next iteration, NULL once the budget is spent
+static inline monte_node_t*
+monte_next_halving_candidate(monte_t* monte) {
+	if (monte->num_halving_candidates == 0 || monte->halving_iterations_left == 0) {
+		return NULL;
+	}
+
+	if (monte->halving_round_iterations_left == 0) {
+		monte_rank_halving_candidates(monte);
+		monte->num_halving_candidates = (monte->num_halving_candidates + 1) / 2;
+		--monte->num_halving_rounds_left;
+		monte_start_halving_round(monte);
+	}
+
+	--monte->halving_round_iterations_left;
+	--monte->halving_iterations_left;
+	monte_index_t index = monte->next_halving_candidate;
+	monte->next_halving_candidate = (index + 1) % monte->num_halving_candidates;
+	return monte->halving_candidates[index].node;
+}
+
+#endif
 
-			node = new_node;
+// Child with the best UCT score, or a winning move. Its position in the list
+// of children goes to `position`. NULL if every child is a lost cause.
+static inline monte_node_t*
+monte_select_child(const monte_t* monte, const monte_node_t* node, monte_index_t* position) {
+	float c = MONTE_CONFIG(monte, exploration_param);
+	monte_player_id_t player = node->current_player;
+	float chosen_uct_score = -INFINITY;
+	monte_node_t* chosen_node = NULL;
+	float parent_log_n = logf((float)MONTE_LOAD(&node->num_visits));
+	monte_index_t index = 0;
+	for (
+		monte_node_t* itr = monte_load_node_acquire(monte, &node->children);
+		itr != NULL;
+		itr = monte_load_node_acquire(monte, &itr->next), ++index
+	) {
+		monte_player_id_t instant_winner = MONTE_LOAD(&itr->instant_winner);
+		if (instant_winner == player) {
+			*position = index;
+			return itr;
+		}
+
+		if (instant_winner != MONTE_INVALID_PLAYER && instant_winner != player) {
+			continue;
+		}
+
+		monte_visit_t num_visits = MONTE_LOAD(&itr->num_visits);
+		float win_rate = monte_win_rate(MONTE_LOAD(&itr->value), num_visits);
+		float explore_rate = c * sqrtf(parent_log_n / (float)num_visits);
+		float uct_score = win_rate + explore_rate;
+		if (uct_score > chosen_uct_score) {
+			chosen_uct_score = uct_score;
+			chosen_node = itr;
+			*position = index;
 		}
 	}
 
-	// Simulation
-	monte_state_info_t* sim_state_info = monte->tmp_state_info2;
-	monte_user_inspect_state(state, sim_state_info);
-	while (sim_state_info->current_player != MONTE_INVALID_PLAYER) {
-		monte_move_t move = monte_pick_move_for_simulation(state, monte);
-		monte_user_apply_move(state, &move);
-		monte_user_inspect_state(state, sim_state_info);
+	return chosen_node;
+}
+
+// Play a move on the selected path. Only the leaf needs describing, which
+// the fused hook does along the way.
+static inline void
+monte_select_move(monte_state_t* state, const monte_move_t* move, monte_state_info_t* info) {
+#ifdef MONTE_ENABLE_APPLY_AND_INSPECT
+	monte_user_apply_and_inspect(state, move, info);
+#else
+	(void)info;
+	monte_user_apply_move(state, move);
+#endif
+}
+
+static inline monte_node_t*
+monte_select_and_expand(monte_t* monte, monte_state_t* state, monte_state_info_t* state_info) {
+	// Selection
+	monte_node_t* node = monte->root;
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+	monte_node_t* candidate = monte_next_halving_candidate(monte);
+	if (candidate != NULL) {
+		monte_select_move(state, &candidate->move, state_info);
+		node = candidate;
+	}
+#endif
+#ifdef MONTE_ENABLE_TRACE
+	bool tracing = monte->trace_fn != NULL;
+	if (tracing && node != monte->root) {
+		monte_trace_put_byte(monte, MONTE_TRACE_SELECT_CANDIDATE);
+		monte_trace_put_varint(monte, (uint64_t)monte_child_position(monte, monte->root, node) + 1);
+	} else if (tracing) {
+		monte_trace_put_byte(monte, MONTE_TRACE_SELECT);
+	}
+#endif
+	while (MONTE_LOAD(&node->num_moves_left) == 0 || monte_node_is_widened(monte, node)) {
+		monte_index_t position;
+		monte_node_t* chosen_node = monte_select_child(monte, node, &position);
+		if (chosen_node == NULL) { break; }
+
+		monte_select_move(state, &chosen_node->move, state_info);
+		node = chosen_node;
+#ifdef MONTE_ENABLE_TRACE
+		if (tracing) { monte_trace_put_varint(monte, (uint64_t)position + 1); }
+#endif
+	}
+#ifdef MONTE_ENABLE_TRACE
+	if (tracing) { monte_trace_put_byte(monte, 0); }
+#endif
+
+	// Expansion
+#ifdef MONTE_ENABLE_APPLY_AND_INSPECT
+	// Already described by monte_select_move unless nothing was played
+	if (node == monte->root) { monte_user_inspect_state(state, state_info); }
+#else
+	monte_user_inspect_state(state, state_info);
+#endif
+	if (state_info->current_player != MONTE_INVALID_PLAYER && monte_lock_node(node)) {
+		monte_node_t* parent = node;
+		monte_node_t* new_node = monte_add_child(monte, parent, state, state_info);
+		if (new_node != NULL) { node = new_node; }
+
+		monte_unlock_node(parent);
 	}
+#ifdef MONTE_ENABLE_TRACE
+	else if (tracing) {
+		monte_trace_put_byte(monte, 0);
+	}
+	monte_player_id_t winner = MONTE_INVALID_PLAYER;
+#endif
 
 	if (state_info->current_player == MONTE_INVALID_PLAYER) {
 		for (
 			monte_player_id_t player_index = 0;
-			player_index < monte->config.num_players;
+			player_index < MONTE_CONFIG(monte, num_players);
 			++player_index
 		) {
 			if (state_info->scores[player_index] > 0) {
-				node->instant_winner = player_index;
+				monte_set_instant_winner(monte, node, player_index);
+#ifdef MONTE_ENABLE_TRACE
+				winner = player_index;
+#endif
 				break;
 			}
 		}
 	}
+#ifdef MONTE_ENABLE_TRACE
+	if (tracing) { monte_trace_put_player(monte, winner); }
+#endif
+
+	return node;
+}
+
+static inline void
+monte_add_visit(monte_t* monte, monte_node_t* node) {
+	// Visits are counted before the outcome is known so that iterations
+	// which are still in flight (see monte_iterate_batch) discourage
+	// selection from piling onto the same path.
+	for (; node != NULL; node = monte_parent(monte, node)) {
+		monte_visit_t num_visits = MONTE_LOAD(&node->num_visits);
+		if (num_visits >= monte_visit_limit()) {
+			// Rescale rather than saturate so that the node keeps learning.
+			// Only this node is rescaled, its children keep their counts.
+			MONTE_STORE(&node->num_visits, num_visits / 2);
+			MONTE_STORE(&node->value, MONTE_LOAD(&node->value) / 2);
+		}
+
+		MONTE_ADD(&node->num_visits, 1);
+#ifdef MONTE_ENABLE_SHARED
+		// Taken back in monte_backpropagate
+		if (monte->config.virtual_loss != 0.f && node->parent != 0) {
+			MONTE_ADD_VALUE(&node->value, monte_value_from_reward(-monte->config.virtual_loss));
+		}
+#endif
+	}
+}
+
+// Play until the game ends or the depth limit, recording up to
+// MONTE_UNDO_BUFFER_SIZE moves into `moves` unless it is NULL.
+// `sim_state_info` describes `state` on entry and is updated as it is played.
+// Return the number of moves played.
+static inline monte_index_t
+monte_simulate(
+	monte_t* monte,
+	monte_state_t* state,
+	monte_state_info_t* sim_state_info,
+	float* values,
+	monte_move_t* moves
+) {
+	monte_index_t depth = 0;
+	for (; sim_state_info->current_player != MONTE_INVALID_PLAYER; ++depth) {
+#ifdef MONTE_ENABLE_EVALUATION
+		monte_index_t max_depth = MONTE_CONFIG(monte, max_rollout_depth);
+		if (depth == max_depth && max_depth > 0) {
+			monte_user_evaluate_state(state, values);
+			return depth;
+		}
+#endif
+
+		monte_move_t move = monte_pick_rollout_move(state, monte);
+		monte_apply_and_inspect(state, &move, sim_state_info);
+		if (moves != NULL && depth < MONTE_UNDO_BUFFER_SIZE) {
+			moves[depth] = move;
+		}
+	}
+
+	for (
+		monte_player_id_t player_index = 0;
+		player_index < MONTE_CONFIG(monte, num_players);
+		++player_index
+	) {
+		values[player_index] = (float)sim_state_info->scores[player_index];
+	}
+
+	return depth;
+}
+
+static inline void
+monte_backpropagate(monte_t* monte, monte_node_t* node, const float* values) {
+	float virtual_loss = 0.f;
+#ifdef MONTE_ENABLE_SHARED
+	virtual_loss = monte->config.virtual_loss;
+#endif
 
-	// Backpropagation
-	while (node->parent != NULL) {
-		monte_node_t* parent = node->parent;
+	while (node->parent != 0) {
+		monte_node_t* parent = monte_parent(monte, node);
 		monte_player_id_t player = parent->current_player;
-		node->num_visits += 1;
-		node->num_wins += sim_state_info->scores[player];
+		MONTE_ADD_VALUE(&node->value, monte_value_from_reward(values[player] + virtual_loss));
 
 		// If the selected move is a game ending move
-		monte_player_id_t instant_winner = node->instant_winner;
+		monte_player_id_t instant_winner = MONTE_LOAD(&node->instant_winner);
 		if (instant_winner != MONTE_INVALID_PLAYER) {
 			if (instant_winner == player) {
 				// If the player about to act will win in one move, they will
 				// take it.
-				parent->instant_winner = instant_winner;
-			} else if (parent->num_moves_left == 0) {
+				monte_set_instant_winner(monte, parent, instant_winner);
+			} else if (
+				MONTE_LOAD(&parent->num_moves_left) == 0
+				&& MONTE_LOAD(&parent->num_proven_children) == MONTE_LOAD(&parent->num_children)
+				&& MONTE_LOAD(&parent->proven_winner) == instant_winner
+			) {
 				// If all siblings lead to the same outcome, parent is a game
 				// ending move.
-				bool same_winner = true;
-				for (
-					monte_node_t* itr = parent->children;
-					itr != NULL;
-					itr = itr->next
-				) {
-					if (itr->instant_winner != instant_winner) {
-						same_winner = false;
-						break;
-					}
-				}
-
-				if (same_winner) {
-					parent->instant_winner = instant_winner;
-				}
+				monte_set_instant_winner(monte, parent, instant_winner);
 			}
 		}
 
 		node = parent;
 	}
-	monte->root->num_visits += 1;
 }
 
+void
+monte_iterate(monte_t* monte) {
+	monte_state_t* state = monte->tmp_state;
+#ifdef MONTE_ENABLE_UNDO
+	// tmp_state mirrors current_state between iterations
+	monte_move_t rollout_moves[MONTE_UNDO_BUFFER_SIZE];
+#else
+	monte_user_copy_state(state, monte->current_state);
+	monte_move_t* rollout_moves = NULL;
+#endif
+
+	monte_node_t* node = monte_select_and_expand(monte, state, monte->tmp_state_info);
+	monte_add_visit(monte, node);
+
+	float* values = monte->tmp_values;
+	// Selection left the leaf described in tmp_state_info
+	monte_index_t num_rollout_moves = monte_simulate(
+		monte, state, monte->tmp_state_info, values, rollout_moves
+	);
+
+#ifdef MONTE_ENABLE_TRACE
+	if (monte->trace_fn != NULL) { monte_trace_backup(monte, values); }
+#endif
+	monte_backpropagate(monte, node, values);
+
+#ifdef MONTE_ENABLE_UNDO
+	if (num_rollout_moves > MONTE_UNDO_BUFFER_SIZE) {
+		// Too long to unwind
+		monte_user_copy_state(state, monte->current_state);
+		return;
+	}
+
+	while (num_rollout_moves > 0) {
+		monte_user_undo_move(state, &rollout_moves[--num_rollout_moves]);
+	}
+	for (monte_node_t* itr = node; itr != monte->root; itr = monte_parent(monte, itr)) {
+		monte_user_undo_move(state, &itr->move);
+	}
+#else
+	(void)num_rollout_moves;
+#endif
+}
+
+#ifdef MONTE_BATCH_SIZE
+
+void
+monte_iterate_batch(monte_t* monte) {
+	for (monte_index_t i = 0; i < MONTE_BATCH_SIZE; ++i) {
+		monte_state_t* state = monte->batch_states[i];
+		monte_user_copy_state(state, monte->current_state);
+
+		monte_node_t* node = monte_select_and_expand(monte, state, monte->tmp_state_info);
+		monte_add_visit(monte, node);
+		monte->batch_nodes[i] = node;
+	}
+
+	monte_index_t max_depth = 0;
+#ifdef MONTE_ENABLE_EVALUATION
+	max_depth = MONTE_CONFIG(monte, max_rollout_depth);
+#endif
+	monte_user_simulate_batch(
+		monte->batch_states,
+		MONTE_BATCH_SIZE,
+		max_depth,
+		&monte->config.rng_state,
+		monte->batch_values
+	);
+
+	for (monte_index_t i = 0; i < MONTE_BATCH_SIZE; ++i) {
+		float* values = monte->batch_values + i * MONTE_CONFIG(monte, num_players);
+#ifdef MONTE_ENABLE_TRACE
+		if (monte->trace_fn != NULL) { monte_trace_backup(monte, values); }
+#endif
+		monte_backpropagate(monte, monte->batch_nodes[i], values);
+	}
+}
+
+#endif
+
 static float
 monte_node_score(monte_node_t* node) {
-	return node->num_visits;
+	return (float)MONTE_LOAD(&node->num_visits);
 }
 
 void
 monte_pick_move(monte_t* monte, monte_move_t* move, float* score) {
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+	if (monte->num_halving_candidates > 0) {
+		monte_rank_halving_candidates(monte);
+		monte_node_t* best_node = monte->halving_candidates[0].node;
+		*move = best_node->move;
+		*score = monte_node_score(best_node);
+		return;
+	}
+#endif
+
 	float best_score = -INFINITY;
 	for (
-		monte_node_t* itr = monte->root->children;
+		monte_node_t* itr = monte_load_node_acquire(monte, &monte->root->children);
 		itr != NULL;
-		itr = itr->next
+		itr = monte_load_node_acquire(monte, &itr->next)
 	) {
 		float score = monte_node_score(itr);
 		if (score > best_score) {
@@ -515,6 +1882,351 @@ monte_pick_move(monte_t* monte, monte_move_t* move, float* score) {
 	*score = best_score;
 }
 
+#ifdef MONTE_ENABLE_COMPACTION
+
+// Pre-order walk through the child, sibling and parent links, no stack needed
+static inline size_t
+monte_count_nodes(const monte_t* monte, monte_node_t* root) {
+	size_t num_nodes = 0;
+	monte_node_t* node = root;
+	for (;;) {
+		++num_nodes;
+
+		monte_node_t* child = monte_load_node(monte, &node->children);
+		if (child != NULL) {
+			node = child;
+			continue;
+		}
+
+		while (node != root && monte_load_node(monte, &node->next) == NULL) {
+			node = monte_parent(monte, node);
+		}
+		if (node == root) { return num_nodes; }
+
+		node = monte_load_node(monte, &node->next);
+	}
+}
+
+static inline bool
+monte_in_block(const monte_node_t* node, const monte_node_t* block, size_t capacity) {
+	return (uintptr_t)node - (uintptr_t)block < sizeof(monte_node_t) * capacity;
+}
+
+// Free an old node, unless it is in the vacated block
+static inline void
+monte_free_compacted(monte_t* monte, monte_node_t* node, const monte_node_t* vacated, size_t vacated_capacity) {
+	if (monte_in_block(node, vacated, vacated_capacity)) { return; }
+
+	monte_store_node(monte, &node->next, monte->node_pool);
+	monte->node_pool = node;
+}
+
+bool
+monte_compact(monte_t* monte) {
+#ifdef MONTE_ENABLE_SHARED
+	// Other searchers may be following the old links
+	if (monte->shared != NULL) { return false; }
+#endif
+
+	monte_node_t* root = monte->root;
+	size_t num_nodes = monte_count_nodes(monte, root);
+
+	int target = 1 - monte->compact_block;
+	if (monte->compact_block_capacity[target] < num_nodes) {
+		// Too small, its nodes go to the free list like any others
+		monte_node_t* block = monte->compact_blocks[target];
+		for (size_t i = 0; i < monte->compact_block_capacity[target]; ++i) {
+			monte_store_node(monte, &block[i].next, monte->node_pool);
+			monte->node_pool = &block[i];
+		}
+
+		// Room for the tree to grow until the next compaction
+		size_t capacity = num_nodes + num_nodes / 2;
+		block = (monte_node_t*)monte_alloc_tree_memory(
+			monte, sizeof(monte_node_t) * capacity, MONTE_ALIGNOF(monte_node_t)
+		);
+		monte->compact_blocks[target] = block;
+		monte->compact_block_capacity[target] = block != NULL ? capacity : 0;
+		if (block == NULL) { return false; }
+	}
+
+	monte_node_t* nodes = monte->compact_blocks[target];
+	const monte_node_t* vacated = monte->compact_blocks[monte->compact_block];
+	size_t vacated_capacity = monte->compact_block_capacity[monte->compact_block];
+
+	// Cheney's algorithm: the copied nodes are the queue. Each old node
+	// forwards to its copy through its parent link until it is reused.
+	nodes[0] = *root;
+	monte_store_node(monte, &nodes[0].next, NULL);
+	root->parent = monte_ref(monte, &nodes[0]);
+	monte_free_compacted(monte, root, vacated, vacated_capacity);
+
+	size_t num_copied = 1;
+	for (size_t scan = 0; scan < num_copied; ++scan) {
+		monte_node_t* parent = &nodes[scan];
+		monte_node_t* prev = NULL;
+		for (
+			monte_node_t* itr = monte_load_node(monte, &parent->children);
+			itr != NULL;
+		) {
+			monte_node_t* next = monte_load_node(monte, &itr->next);
+
+			monte_node_t* copy = &nodes[num_copied++];
+			*copy = *itr;
+			copy->parent = monte_ref(monte, parent);
+			monte_store_node(monte, &copy->next, NULL);
+			if (prev != NULL) {
+				monte_store_node(monte, &prev->next, copy);
+			} else {
+				monte_store_node(monte, &parent->children, copy);
+			}
+			prev = copy;
+
+			// The copy owns the untried moves now
+			itr->parent = monte_ref(monte, copy);
+			monte_free_compacted(monte, itr, vacated, vacated_capacity);
+
+			itr = next;
+		}
+	}
+
+	// Nodes of the vacated block which were freed before, by
+	// monte_apply_move, must not be handed out either
+	if (vacated_capacity > 0) {
+		monte_node_t* pool = monte->node_pool;
+		monte->node_pool = NULL;
+		while (pool != NULL) {
+			monte_node_t* next = monte_load_node(monte, &pool->next);
+			monte_free_compacted(monte, pool, vacated, vacated_capacity);
+			pool = next;
+		}
+	}
+
+	// The rest of the block goes to the next expansions, which then stay
+	// close to the tree
+	for (size_t i = monte->compact_block_capacity[target]; i > num_copied; --i) {
+		monte_store_node(monte, &nodes[i - 1].next, monte->node_pool);
+		monte->node_pool = &nodes[i - 1];
+	}
+
+	monte->root = &nodes[0];
+	monte->compact_block = target;
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+	for (monte_index_t i = 0; i < monte->num_halving_candidates; ++i) {
+		monte_halving_candidate_t* candidate = &monte->halving_candidates[i];
+		candidate->node = monte_parent(monte, candidate->node);
+	}
+#endif
+
+	return true;
+}
+
+#endif
+
+#ifdef MONTE_ENABLE_STEP
+
+static monte_index_t
+monte_run_step(monte_t* monte, uint64_t max_ns, monte_index_t max_iterations, bool batch) {
+	uint64_t now = monte_clock_ns();
+	// Saturated, so that a budget like UINT64_MAX means no deadline
+	uint64_t deadline = max_ns < UINT64_MAX - now ? now + max_ns : UINT64_MAX;
+	monte_index_t num_iterations = 0;
+	while (now < deadline && num_iterations < max_iterations) {
+		// Run for about half of the time left, so there are only a few
+		// clock reads per call and the last run is a single iteration
+		uint64_t ns_per_iteration = monte->step_ns_per_iteration;
+		uint64_t run_length = ns_per_iteration > 0
+			? (deadline - now) / 2 / ns_per_iteration
+			: 1;
+		if (run_length < 1) { run_length = 1; }
+#ifdef MONTE_BATCH_SIZE
+		if (batch) {
+			run_length = (run_length + MONTE_BATCH_SIZE - 1) / MONTE_BATCH_SIZE * MONTE_BATCH_SIZE;
+		}
+#else
+		(void)batch;
+#endif
+		uint64_t num_left = (uint64_t)(max_iterations - num_iterations);
+		if (run_length > num_left) { run_length = num_left; }
+
+		uint64_t i = 0;
+#ifdef MONTE_BATCH_SIZE
+		if (batch) {
+			for (; i + MONTE_BATCH_SIZE <= run_length; i += MONTE_BATCH_SIZE) {
+				monte_iterate_batch(monte);
+			}
+		}
+#endif
+		for (; i < run_length; ++i) {
+			monte_iterate(monte);
+		}
+		num_iterations += (monte_index_t)run_length;
+
+		uint64_t then = monte_clock_ns();
+		uint64_t measured = (then - now) / run_length;
+		if (measured < 1) { measured = 1; }
+		monte->step_ns_per_iteration = ns_per_iteration > 0
+			? (ns_per_iteration * 3 + measured) / 4
+			: measured;
+		now = then;
+	}
+
+	return num_iterations;
+}
+
+monte_index_t
+monte_step(monte_t* monte, uint64_t max_ns, monte_index_t max_iterations) {
+	return monte_run_step(monte, max_ns, max_iterations, false);
+}
+
+#ifdef MONTE_BATCH_SIZE
+monte_index_t
+monte_step_batch(monte_t* monte, uint64_t max_ns, monte_index_t max_iterations) {
+	return monte_run_step(monte, max_ns, max_iterations, true);
+}
+#endif
+
+#endif
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+
+void
+monte_start_halving(monte_t* monte, monte_index_t num_iterations) {
+	monte->num_halving_candidates = 0;
+
+	monte_node_t* root = monte->root;
+	monte_state_info_t* state_info = monte->tmp_state_info;
+	monte_user_inspect_state(monte->current_state, state_info);
+	if (state_info->current_player == MONTE_INVALID_PLAYER) { return; }
+
+	// Candidates are visited through their child node, so all of them are
+	// needed up front
+	monte_state_t* state = monte->tmp_state;
+	while (!monte_lock_node(root)) {}
+	for (;;) {
+#ifndef MONTE_ENABLE_UNDO
+		monte_user_copy_state(state, monte->current_state);
+#endif
+#ifdef MONTE_ENABLE_TRACE
+		if (monte->trace_fn != NULL) { monte_trace_put_byte(monte, MONTE_TRACE_EXPAND); }
+#endif
+		monte_node_t* child = monte_add_child(monte, root, state, state_info);
+		if (child == NULL) { break; }
+#ifdef MONTE_ENABLE_UNDO
+		monte_user_undo_move(state, &child->move);
+#endif
+	}
+	monte_unlock_node(root);
+
+	monte_index_t num_children = MONTE_LOAD(&root->num_children);
+	if (num_children > monte->halving_capacity) {
+		// The old buffer stays in the arena
+		monte->halving_candidates = (monte_halving_candidate_t*)monte_user_alloc(
+			sizeof(monte_halving_candidate_t) * num_children,
+			MONTE_ALIGNOF(monte_halving_candidate_t),
+			monte->config.allocator_ctx
+		);
+		monte->halving_capacity = num_children;
+	}
+
+	monte_index_t num_candidates = 0;
+	float gumbel_scale = monte->config.halving_gumbel_scale;
+	for (
+		monte_node_t* itr = monte_load_node_acquire(monte, &root->children);
+		itr != NULL && num_candidates < num_children;
+		itr = monte_load_node_acquire(monte, &itr->next)
+	) {
+		float noise = 0.f;
+#ifdef MONTE_ENABLE_MOVE_PRIORITY
+		noise = monte_user_move_priority(monte->current_state, &itr->move);
+#endif
+		if (gumbel_scale > 0.f) {
+			float u = monte_user_rng_next(&monte->config.rng_state);
+			if (u <= 0.f) { u = FLT_MIN; }
+			noise -= gumbel_scale * logf(-logf(u));
+		} else {
+			// Random order among equal priorities
+			noise += monte_user_rng_next(&monte->config.rng_state) * 1e-3f;
+		}
+
+		monte->halving_candidates[num_candidates++] = (monte_halving_candidate_t){
+			.node = itr,
+			.noise = noise,
+			.score = noise,
+		};
+	}
+
+	qsort(
+		monte->halving_candidates, num_candidates, sizeof(monte_halving_candidate_t),
+		monte_compare_halving_candidates
+	);
+	monte_index_t max_candidates = monte->config.halving_num_candidates;
+	if (max_candidates > 0 && num_candidates > max_candidates) {
+		num_candidates = max_candidates;
+	}
+
+	monte_index_t num_rounds = 1;
+	while (((monte_index_t)1 << num_rounds) < num_candidates) { ++num_rounds; }
+
+	monte->num_halving_candidates = num_candidates;
+	monte->num_halving_rounds_left = num_rounds;
+	monte->halving_iterations_left = num_iterations;
+	monte_start_halving_round(monte);
+}
+
+#endif
+
+#ifdef MONTE_ENABLE_SNAPSHOT
+
+void
+monte_snapshot(const monte_t* monte, monte_snapshot_t* out) {
+	const monte_node_t* root = monte->root;
+	out->num_visits = MONTE_LOAD(&root->num_visits);
+
+	out->num_children = 0;
+	for (
+		monte_node_t* itr = monte_load_node_acquire(monte, &root->children);
+		itr != NULL && out->num_children < out->max_children;
+		itr = monte_load_node_acquire(monte, &itr->next)
+	) {
+		monte_visit_t num_visits = MONTE_LOAD(&itr->num_visits);
+		monte_value_t value = MONTE_LOAD(&itr->value);
+		out->children[out->num_children++] = (monte_snapshot_child_t){
+			.move = itr->move,
+			.num_visits = num_visits,
+			.win_rate = num_visits > 0 ? monte_win_rate(value, num_visits) : 0.f,
+		};
+	}
+
+	out->pv_length = 0;
+	for (
+		const monte_node_t* node = root;
+		out->pv_length < out->max_pv_length;
+	) {
+		monte_node_t* best_child = NULL;
+		monte_visit_t best_num_visits = 0;
+		for (
+			monte_node_t* itr = monte_load_node_acquire(monte, &node->children);
+			itr != NULL;
+			itr = monte_load_node_acquire(monte, &itr->next)
+		) {
+			monte_visit_t num_visits = MONTE_LOAD(&itr->num_visits);
+			if (num_visits > best_num_visits) {
+				best_child = itr;
+				best_num_visits = num_visits;
+			}
+		}
+
+		if (best_child == NULL) { break; }
+
+		out->pv[out->pv_length++] = best_child->move;
+		node = best_child;
+	}
+}
+
+#endif
+
+#ifndef MONTE_MOVE_CURSOR_TYPE
 void
 monte_submit_move(monte_iterator_t* itr, const monte_move_t* move) {
 	if (itr->fn == monte_submit_move_for_expansion) {
@@ -526,57 +2238,495 @@ monte_submit_move(monte_iterator_t* itr, const monte_move_t* move) {
 	}
 
 }
+#endif
 
-void
-monte_apply_move(monte_t* monte, const monte_move_t* move) {
-	monte_node_t* new_root = NULL;
+// Free every child of the root but `keep`, along with their subtrees
+static void
+monte_recycle_siblings(monte_t* monte, monte_node_t* keep) {
 	monte_node_t* recycle_root = NULL;
 	for (
-		monte_node_t* itr = monte->root->children;
+		monte_node_t* itr = monte_load_node(monte, &monte->root->children);
 		itr != NULL;
 	) {
-		monte_node_t* next = itr->next;
-
-		if (monte_user_moves_equal(&itr->move, move)) {
-			new_root = itr;
-		} else {
-			itr->next = recycle_root;
+		monte_node_t* next = monte_load_node(monte, &itr->next);
+		if (itr != keep) {
+			monte_store_node(monte, &itr->next, recycle_root);
 			recycle_root = itr;
 		}
-
 		itr = next;
 	}
 
 	while (recycle_root != NULL) {
 		monte_node_t* node = recycle_root;
-		recycle_root = node->next;
+		recycle_root = monte_load_node(monte, &node->next);
 
 		for (
-			monte_node_t* itr = node->children;
+			monte_node_t* itr = monte_load_node(monte, &node->children);
 			itr != NULL;
 		) {
-			monte_node_t* itr_next = itr->next;
-			itr->next = recycle_root;
+			monte_node_t* itr_next = monte_load_node(monte, &itr->next);
+			monte_store_node(monte, &itr->next, recycle_root);
 			recycle_root = itr;
 			itr = itr_next;
 		}
 
 		monte_free_node(node, monte);
 	}
+}
+
+void
+monte_apply_move(monte_t* monte, const monte_move_t* move) {
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+	monte->num_halving_candidates = 0;
+#endif
+#ifdef MONTE_ENABLE_SHARED
+	// Other searchers may still be holding on to the old tree
+	bool recycle = monte->shared == NULL;
+#else
+	bool recycle = true;
+#endif
+
+#ifdef MONTE_ENABLE_CANONICALIZATION
+	// Only canonical moves were expanded
+	monte_move_t canonical_move = *move;
+	monte_user_canonicalize(monte->current_state, &canonical_move);
+	move = &canonical_move;
+#endif
+
+	monte_node_t* new_root = NULL;
+	monte_index_t position = 0;
+	for (
+		monte_node_t* itr = monte_load_node(monte, &monte->root->children);
+		itr != NULL;
+		itr = monte_load_node(monte, &itr->next), ++position
+	) {
+		if (monte_user_moves_equal(&itr->move, move)) {
+			new_root = itr;
+			break;
+		}
+	}
+
+	if (recycle) {
+		monte_recycle_siblings(monte, new_root);
+	}
 
 	monte_user_apply_move(monte->current_state, move);
+#ifdef MONTE_ENABLE_UNDO
+	monte_user_apply_move(monte->tmp_state, move);
+#endif
 
 	if (new_root == NULL) {
-		new_root = monte_alloc_node(monte);
-		*new_root = (monte_node_t){
-			.num_moves_left = -1,
-		};
-		monte_user_inspect_state(monte->current_state, monte->tmp_state_info);
-		new_root->current_player = monte->tmp_state_info->current_player;
+		new_root = monte_create_root(monte);
+	}
+#ifdef MONTE_ENABLE_TRACE
+	if (monte->trace_fn != NULL) {
+		monte_trace_put_byte(monte, MONTE_TRACE_APPLY);
+		if (monte_parent(monte, new_root) == monte->root) {
+			monte_trace_put_varint(monte, (uint64_t)position + 1);
+		} else {
+			monte_trace_put_varint(monte, 0);
+			monte_trace_put_player(monte, new_root->current_player);
+		}
+	}
+#else
+	(void)position;
+#endif
+
+#ifdef MONTE_ENABLE_SHARED
+	if (monte->shared != NULL) {
+		// The first searcher to apply the move publishes the new root, the
+		// others pick it up
+		monte_ref_t root_ref = monte_ref(monte, monte->root);
+		if (!atomic_compare_exchange_strong_explicit(
+			&monte->shared->root, &root_ref, monte_ref(monte, new_root),
+			memory_order_acq_rel, memory_order_acquire
+		)) {
+			monte->root = (monte_node_t*)monte_deref(monte, root_ref);
+			return;
+		}
 	}
+#endif
 
-	new_root->parent = NULL;
+	new_root->parent = 0;
 	monte->root = new_root;
 }
 
+#ifdef MONTE_ENABLE_TRACE
+
+void
+monte_trace(monte_t* monte, monte_trace_fn_t fn, void* userdata) {
+	if (monte->trace_fn != NULL) {
+		monte_trace_flush(monte);
+	}
+	monte->trace_fn = fn;
+	monte->trace_userdata = userdata;
+	if (fn == NULL) { return; }
+
+	if (monte->trace_buffer == NULL) {
+		monte->trace_buffer = (uint8_t*)monte_user_alloc(
+			MONTE_TRACE_BUFFER_SIZE, 1, monte->config.allocator_ctx
+		);
+	}
+
+	for (const char* magic = "MNTR"; *magic != '\0'; ++magic) {
+		monte_trace_put_byte(monte, (uint8_t)*magic);
+	}
+	monte_trace_put_byte(monte, MONTE_TRACE_VERSION);
+	monte_trace_put_byte(monte, (uint8_t)MONTE_CONFIG(monte, num_players));
+	monte_trace_put_float(monte, MONTE_CONFIG(monte, exploration_param));
+	monte_trace_put_float(monte, MONTE_CONFIG(monte, widening_coefficient));
+	monte_trace_put_float(monte, MONTE_CONFIG(monte, widening_exponent));
+	monte_trace_put_player(monte, monte->root->current_player);
+}
+
+#endif
+
+#ifdef MONTE_ENABLE_REPLAY
+
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+	bool error;
+} monte_trace_reader_t;
+
+static inline uint8_t
+monte_trace_get_byte(monte_trace_reader_t* reader) {
+	if (reader->offset >= reader->size) {
+		reader->error = true;
+		return 0;
+	}
+	return reader->data[reader->offset++];
+}
+
+static inline uint64_t
+monte_trace_get_varint(monte_trace_reader_t* reader) {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		uint8_t byte = monte_trace_get_byte(reader);
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) { return value; }
+	}
+	reader->error = true;
+	return 0;
+}
+
+static inline float
+monte_trace_get_float(monte_trace_reader_t* reader) {
+	uint32_t bits = 0;
+	for (int i = 0; i < 4; ++i) {
+		bits |= (uint32_t)monte_trace_get_byte(reader) << (i * 8);
+	}
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static inline monte_player_id_t
+monte_trace_get_player(monte_trace_reader_t* reader) {
+	return (monte_player_id_t)(monte_trace_get_byte(reader) - 1);
+}
+
+static monte_node_t*
+monte_replay_expansion(monte_t* monte, monte_trace_reader_t* reader, monte_node_t* parent) {
+	uint8_t flags = monte_trace_get_byte(reader);
+	if ((flags & MONTE_TRACE_FIRST_EXPANSION) != 0) {
+		uint64_t num_moves = monte_trace_get_varint(reader);
+		if (parent->num_moves_left >= 0 || num_moves > (uint64_t)INT32_MAX) {
+			reader->error = true;
+			return NULL;
+		}
+		parent->num_moves_left = (monte_index_t)num_moves;
+	}
+	if ((flags & MONTE_TRACE_EXPANDED) == 0) { return NULL; }
+
+	monte_player_id_t current_player = monte_trace_get_player(reader);
+	if (reader->error || parent->num_moves_left <= 0) {
+		reader->error = true;
+		return NULL;
+	}
+
+	monte_node_t* new_node = monte_alloc_node(monte);
+	if (new_node == NULL) {
+		reader->error = true;
+		return NULL;
+	}
+
+	monte_move_t move;
+	memset(&move, 0, sizeof(move));
+	monte_link_child(monte, parent, new_node, &move, current_player);
+	parent->num_moves_left -= 1;
+	return new_node;
+}
+
+static monte_node_t*
+monte_child_at(const monte_t* monte, const monte_node_t* parent, uint64_t position) {
+	monte_node_t* itr = monte_load_node(monte, &parent->children);
+	for (; itr != NULL && position > 0; --position) {
+		itr = monte_load_node(monte, &itr->next);
+	}
+	return itr;
+}
+
+monte_index_t
+monte_replay(
+	monte_t* monte,
+	const void* trace,
+	size_t size,
+	monte_index_t* num_divergences
+) {
+	monte_trace_reader_t reader = { .data = trace, .size = size };
+	*num_divergences = 0;
+
+	if (size < 4 || memcmp(trace, "MNTR", 4) != 0) { return -1; }
+	reader.offset = 4;
+	if (monte_trace_get_byte(&reader) != MONTE_TRACE_VERSION) { return -1; }
+	if (monte_trace_get_byte(&reader) != (uint8_t)MONTE_CONFIG(monte, num_players)) { return -1; }
+	monte->config.exploration_param = monte_trace_get_float(&reader);
+	monte->config.widening_coefficient = monte_trace_get_float(&reader);
+	monte->config.widening_exponent = monte_trace_get_float(&reader);
+	monte->root->current_player = monte_trace_get_player(&reader);
+
+	monte_node_t* pending[MONTE_TRACE_MAX_PENDING];
+	monte_index_t first_pending = 0;
+	monte_index_t num_pending = 0;
+	float* values = monte->tmp_values;
+	monte_index_t num_iterations = 0;
+	while (!reader.error && reader.offset < reader.size) {
+		uint8_t type = monte_trace_get_byte(&reader);
+		switch (type) {
+			case MONTE_TRACE_SELECT:
+			case MONTE_TRACE_SELECT_CANDIDATE: {
+				monte_node_t* node = monte->root;
+				for (bool by_uct = type == MONTE_TRACE_SELECT; ; by_uct = true) {
+					uint64_t position = monte_trace_get_varint(&reader);
+					if (reader.error) { return -1; }
+					if (position == 0) { break; }
+
+					monte_index_t chosen_position = -1;
+					monte_node_t* chosen_node = by_uct
+						? monte_select_child(monte, node, &chosen_position)
+						: NULL;
+					if (chosen_node == NULL || (uint64_t)chosen_position + 1 != position) {
+						if (by_uct) { *num_divergences += 1; }
+						chosen_node = monte_child_at(monte, node, position - 1);
+						if (chosen_node == NULL) { return -1; }
+					}
+					node = chosen_node;
+				}
+
+				monte_node_t* new_node = monte_replay_expansion(monte, &reader, node);
+				if (new_node != NULL) { node = new_node; }
+
+				monte_player_id_t winner = monte_trace_get_player(&reader);
+				if (winner != MONTE_INVALID_PLAYER) {
+					monte_set_instant_winner(monte, node, winner);
+				}
+
+				if (reader.error || num_pending == MONTE_TRACE_MAX_PENDING) { return -1; }
+				monte_add_visit(monte, node);
+				pending[(first_pending + num_pending++) % MONTE_TRACE_MAX_PENDING] = node;
+			} break;
+			case MONTE_TRACE_BACKUP: {
+				if (num_pending == 0) { return -1; }
+				for (monte_player_id_t i = 0; i < MONTE_CONFIG(monte, num_players); ++i) {
+					values[i] = monte_trace_get_float(&reader);
+				}
+
+				monte_node_t* node = pending[first_pending];
+				first_pending = (first_pending + 1) % MONTE_TRACE_MAX_PENDING;
+				num_pending -= 1;
+				monte_backpropagate(monte, node, values);
+				num_iterations += 1;
+			} break;
+			case MONTE_TRACE_EXPAND:
+				monte_replay_expansion(monte, &reader, monte->root);
+				break;
+			case MONTE_TRACE_APPLY: {
+				if (num_pending > 0) { return -1; }
+				uint64_t position = monte_trace_get_varint(&reader);
+				monte_node_t* new_root = NULL;
+				if (position > 0) {
+					new_root = monte_child_at(monte, monte->root, position - 1);
+					if (new_root == NULL) { return -1; }
+				}
+				monte_recycle_siblings(monte, new_root);
+				if (new_root == NULL) {
+					new_root = monte_alloc_root(monte, monte_trace_get_player(&reader));
+					if (new_root == NULL) { return -1; }
+				}
+
+#ifdef MONTE_ENABLE_SEQUENTIAL_HALVING
+				monte->num_halving_candidates = 0;
+#endif
+				new_root->parent = 0;
+				monte->root = new_root;
+			} break;
+			default:
+				return -1;
+		}
+	}
+
+	return reader.error ? -1 : num_iterations;
+}
+
+#endif
+
+#ifdef MONTE_ENABLE_SCHEDULER
+
+struct monte_scheduler_s {
+	uint64_t time_slice_ns;
+	int num_workers;
+	thrd_t* workers;
+
+	mtx_t mutex;
+	cnd_t cond;
+	monte_job_t* head;
+	monte_job_t* tail;
+	bool shutdown;
+};
+
+static inline void
+monte_scheduler_push(monte_scheduler_t* scheduler, monte_job_t* job) {
+	job->next = NULL;
+	if (scheduler->tail != NULL) {
+		scheduler->tail->next = job;
+	} else {
+		scheduler->head = job;
+	}
+	scheduler->tail = job;
+}
+
+// Return whether the job is done
+static bool
+monte_scheduler_run_slice(monte_scheduler_t* scheduler, monte_job_t* job) {
+	uint64_t now = monte_clock_ns();
+	uint64_t deadline = job->deadline_ns;
+	if (deadline != 0 && now >= deadline) { return true; }
+
+	uint64_t slice_end = now + scheduler->time_slice_ns;
+	if (deadline != 0 && deadline < slice_end) { slice_end = deadline; }
+
+	for (;;) {
+		monte_index_t num_iterations = MONTE_SCHEDULER_CLOCK_INTERVAL;
+		if (job->num_iterations > 0) {
+			monte_index_t num_left = job->num_iterations - job->num_iterations_done;
+			if (num_left < num_iterations) { num_iterations = num_left; }
+		}
+
+		monte_index_t i = 0;
+#ifdef MONTE_BATCH_SIZE
+		if (job->batch) {
+			// Whatever does not fill a batch is done one by one, so that
+			// the job stops at num_iterations
+			for (; i + MONTE_BATCH_SIZE <= num_iterations; i += MONTE_BATCH_SIZE) {
+				monte_iterate_batch(job->monte);
+			}
+		}
+#endif
+		for (; i < num_iterations; ++i) {
+			monte_iterate(job->monte);
+		}
+		job->num_iterations_done += num_iterations;
+
+		if (job->num_iterations > 0 && job->num_iterations_done >= job->num_iterations) {
+			return true;
+		}
+
+		now = monte_clock_ns();
+		if (now >= slice_end) {
+			return deadline != 0 && now >= deadline;
+		}
+	}
+}
+
+static int
+monte_scheduler_worker_main(void* userdata) {
+	monte_scheduler_t* scheduler = userdata;
+
+	mtx_lock(&scheduler->mutex);
+	for (;;) {
+		while (scheduler->head == NULL && !scheduler->shutdown) {
+			cnd_wait(&scheduler->cond, &scheduler->mutex);
+		}
+		if (scheduler->shutdown) { break; }
+
+		monte_job_t* job = scheduler->head;
+		scheduler->head = job->next;
+		if (scheduler->head == NULL) { scheduler->tail = NULL; }
+		mtx_unlock(&scheduler->mutex);
+
+		bool done = monte_scheduler_run_slice(scheduler, job);
+		if (done) {
+			job->done(job);
+			mtx_lock(&scheduler->mutex);
+		} else {
+			// Back of the queue, every other job gets a turn first
+			mtx_lock(&scheduler->mutex);
+			monte_scheduler_push(scheduler, job);
+		}
+	}
+	mtx_unlock(&scheduler->mutex);
+
+	return 0;
+}
+
+monte_scheduler_t*
+monte_scheduler_create(monte_scheduler_config_t config) {
+	monte_scheduler_t* scheduler = (monte_scheduler_t*)monte_user_alloc(
+		sizeof(monte_scheduler_t),
+		MONTE_ALIGNOF(monte_scheduler_t),
+		config.allocator_ctx
+	);
+	*scheduler = (monte_scheduler_t){
+		.time_slice_ns = config.time_slice_ns > 0
+			? config.time_slice_ns
+			: MONTE_SCHEDULER_DEFAULT_TIME_SLICE_NS,
+		.num_workers = config.num_workers,
+		.workers = (thrd_t*)monte_user_alloc(
+			sizeof(thrd_t) * config.num_workers,
+			MONTE_ALIGNOF(thrd_t),
+			config.allocator_ctx
+		),
+	};
+	mtx_init(&scheduler->mutex, mtx_plain);
+	cnd_init(&scheduler->cond);
+
+	for (int i = 0; i < config.num_workers; ++i) {
+		thrd_create(&scheduler->workers[i], monte_scheduler_worker_main, scheduler);
+	}
+
+	return scheduler;
+}
+
+void
+monte_scheduler_destroy(monte_scheduler_t* scheduler) {
+	mtx_lock(&scheduler->mutex);
+	scheduler->shutdown = true;
+	cnd_broadcast(&scheduler->cond);
+	mtx_unlock(&scheduler->mutex);
+
+	for (int i = 0; i < scheduler->num_workers; ++i) {
+		thrd_join(scheduler->workers[i], NULL);
+	}
+
+	cnd_destroy(&scheduler->cond);
+	mtx_destroy(&scheduler->mutex);
+}
+
+void
+monte_scheduler_submit(monte_scheduler_t* scheduler, monte_job_t* job) {
+	job->num_iterations_done = 0;
+	job->deadline_ns = job->time_budget_ns > 0
+		? monte_clock_ns() + job->time_budget_ns
+		: 0;
+
+	mtx_lock(&scheduler->mutex);
+	monte_scheduler_push(scheduler, job);
+	cnd_signal(&scheduler->cond);
+	mtx_unlock(&scheduler->mutex);
+}
+
+#endif
+
 #endif
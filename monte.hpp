@@ -0,0 +1,325 @@
+// C++17 front end to monte.h.
+//
+// The game is a traits class instead of MONTE_* macros and monte_user_*
+// functions:
+//
+//   struct Game {
+//   	using State = ...;  // Default constructible, copyable
+//   	using Move = ...;   // Trivially copyable, comparable with ==
+//   	static constexpr int num_players = 2;
+//
+//   	static void apply(State& state, const Move& move);
+//   	// Call fn(const Move&) for every legal move
+//   	template <typename Fn>
+//   	static void moves(const State& state, Fn&& fn);
+//   	// Return the player to move, or -1 once the game is over, in which
+//   	// case scores (one per player) must be filled in as in
+//   	// monte_state_info_t
+//   	static int inspect(const State& state, std::int32_t* scores);
+//
+//   	// Only with Policy::max_rollout_depth > 0
+//   	static void evaluate(const State& state, float* values);
+//   };
+//
+// Search parameters are compile time constants of a policy class, see
+// DefaultPolicy. Every game and policy pair gets its own copy of monte.h, in
+// a namespace of its own, with the traits inlined as its monte_user_* hooks
+// and the policy folded in through MONTE_CONFIG. Include this header once
+// more for each pair, after defining:
+//
+//   #define MONTE_HPP_GAME Game
+//   #define MONTE_HPP_POLICY Policy  // Optional, DefaultPolicy otherwise
+//   // Name of the namespace, unique in the program
+//   #define MONTE_HPP_INSTANCE game
+//   #include "monte.hpp"
+//
+// monte::Search<Game, Policy> then searches the game, and owns all the
+// memory of its tree. Optional features of monte.h which are not listed in
+// DefaultPolicy are C only, and monte.h itself can't be included next to
+// this header.
+
+#ifndef MONTE_HPP
+#define MONTE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Included again by monte.h inside every instance namespace, where they must
+// already be defined
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace monte {
+
+struct DefaultPolicy {
+	static constexpr float exploration_param = 1.41421356f;
+	// Stop playouts after this many moves and score them with
+	// Game::evaluate. 0 plays until the game ends.
+	static constexpr int max_rollout_depth = 0;
+	// Progressive widening, see monte_config_t. A coefficient of 0 disables it.
+	static constexpr float widening_coefficient = 0.f;
+	static constexpr float widening_exponent = 0.5f;
+	// Tree memory is allocated this many bytes at a time
+	static constexpr std::size_t block_size = std::size_t(1) << 20;
+};
+
+namespace detail {
+
+// Owns everything a search allocates: monte.h never frees
+template <typename State, std::size_t block_size>
+class Arena {
+public:
+	void*
+	alloc(std::size_t size, std::size_t alignment) {
+		std::uintptr_t ptr = align(head_, alignment);
+		if (ptr + size > end_) {
+			// Oversized allocations get a block of their own
+			bool is_oversized = size + alignment > block_size;
+			std::size_t new_size = is_oversized ? size + alignment : block_size;
+			blocks_.emplace_back(new unsigned char[new_size]);
+			std::uintptr_t begin = (std::uintptr_t)blocks_.back().get();
+			ptr = align(begin, alignment);
+			if (is_oversized) { return (void*)ptr; }
+
+			end_ = begin + new_size;
+		}
+
+		head_ = ptr + size;
+		return (void*)ptr;
+	}
+
+	State*
+	create_state() {
+		states_.emplace_back(new State());
+		return states_.back().get();
+	}
+
+private:
+	static std::uintptr_t
+	align(std::uintptr_t value, std::size_t alignment) {
+		return (value + (alignment - 1)) & ~(std::uintptr_t)(alignment - 1);
+	}
+
+	std::vector<std::unique_ptr<unsigned char[]>> blocks_;
+	std::uintptr_t head_ = 0;
+	std::uintptr_t end_ = 0;
+	std::vector<std::unique_ptr<State>> states_;
+};
+
+// Types of the copy of monte.h for a game and policy, specialized by every
+// inclusion with MONTE_HPP_GAME
+template <typename Game, typename Policy>
+struct Instance;
+
+// Game::evaluate only has to exist with a rollout depth
+template <typename Game, typename Policy>
+inline void
+evaluate(const typename Game::State& state, float* values) {
+	if constexpr (Policy::max_rollout_depth > 0) {
+		Game::evaluate(state, values);
+	} else {
+		(void)state;
+		(void)values;
+	}
+}
+
+}
+
+template <typename Game, typename Policy = DefaultPolicy>
+class Search {
+public:
+	using State = typename Game::State;
+	using Move = typename Game::Move;
+
+	static_assert(
+		std::is_trivially_copyable_v<Move>,
+		"monte.h copies moves around as plain memory"
+	);
+
+	explicit Search(const State& initial_state, std::uint64_t seed = 0);
+
+	Search(const Search&) = delete;
+	Search& operator=(const Search&) = delete;
+	Search(Search&&) = default;
+	Search& operator=(Search&&) = default;
+
+	void
+	iterate() { monte_iterate(monte_); }
+
+	// Move with the best score, see monte_pick_move. Return false if there is
+	// none yet.
+	bool
+	pick_move(Move* move, float* score = nullptr) const;
+
+	// Advance the game, keeping the subtree of the move
+	void
+	apply_move(const Move& move) { monte_apply_move(monte_, &move); }
+
+	const State&
+	state() const { return *monte_->current_state; }
+
+private:
+	// Functions of the instance are found through its types
+	using Impl = detail::Instance<Game, Policy>;
+
+	// Behind a pointer, so that moving the search keeps the allocator_ctx of
+	// monte_ valid
+	std::unique_ptr<typename Impl::Arena> arena_;
+	typename Impl::monte_t* monte_;
+};
+
+template <typename Game, typename Policy>
+Search<Game, Policy>::Search(const State& initial_state, std::uint64_t seed)
+	: arena_(new typename Impl::Arena())
+{
+	typename Impl::monte_config_t config = {};
+	config.num_players = (typename Impl::monte_player_id_t)Game::num_players;
+	config.exploration_param = Policy::exploration_param;
+	config.game_config = arena_.get();
+	config.max_rollout_depth = Policy::max_rollout_depth;
+	config.widening_coefficient = Policy::widening_coefficient;
+	config.widening_exponent = Policy::widening_exponent;
+	config.allocator_ctx = arena_.get();
+	config.rng_state = seed;
+	monte_ = monte_create(&initial_state, config);
+}
+
+template <typename Game, typename Policy>
+inline bool
+Search<Game, Policy>::pick_move(Move* move, float* score) const {
+	float best_score;
+	monte_pick_move(monte_, move, &best_score);
+	if (score != nullptr) { *score = best_score; }
+	return best_score > -std::numeric_limits<float>::infinity();
+}
+
+}
+
+#endif
+
+#ifdef MONTE_HPP_GAME
+
+#ifndef MONTE_HPP_INSTANCE
+#	error "MONTE_HPP_INSTANCE must be defined along with MONTE_HPP_GAME"
+#endif
+
+#ifndef MONTE_HPP_POLICY
+#	define MONTE_HPP_POLICY ::monte::DefaultPolicy
+#endif
+
+namespace monte {
+namespace detail {
+namespace MONTE_HPP_INSTANCE {
+
+using Game = MONTE_HPP_GAME;
+using Policy = MONTE_HPP_POLICY;
+using Arena = detail::Arena<Game::State, Policy::block_size>;
+
+// Read by monte.h instead of monte_config_t
+struct Constants : Policy {
+	static constexpr int num_players = Game::num_players;
+};
+
+#undef MONTE_H
+#define MONTE_API static inline
+#define MONTE_USER_FN static
+#define MONTE_IMPLEMENTATION
+#define MONTE_ENABLE_EVALUATION
+#define MONTE_STATE_TYPE Game::State
+#define MONTE_MOVE_TYPE Game::Move
+#define MONTE_GAME_CONFIG_TYPE Arena*
+#define MONTE_ALLOCATOR_CTX_TYPE Arena
+#define MONTE_RNG_STATE_TYPE std::uint64_t
+#define MONTE_CONFIG(monte, field) ((void)(monte), Constants::field)
+#include "monte.h"
+#undef MONTE_API
+#undef MONTE_USER_FN
+#undef MONTE_IMPLEMENTATION
+#undef MONTE_ENABLE_EVALUATION
+#undef MONTE_STATE_TYPE
+#undef MONTE_MOVE_TYPE
+#undef MONTE_GAME_CONFIG_TYPE
+#undef MONTE_ALLOCATOR_CTX_TYPE
+#undef MONTE_RNG_STATE_TYPE
+#undef MONTE_CONFIG
+
+// The hooks
+
+static inline void*
+monte_user_alloc(size_t size, size_t alignment, monte_allocator_ctx_t* ctx) {
+	return ctx->alloc(size, alignment);
+}
+
+// splitmix64, in [0, 1)
+static inline float
+monte_user_rng_next(monte_rng_state_t* rng_state) {
+	std::uint64_t z = (*rng_state += 0x9e3779b97f4a7c15u);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+	z ^= z >> 31;
+	return (float)(z >> 40) * (1.f / (float)(1u << 24));
+}
+
+static inline monte_state_t*
+monte_user_create_state(const monte_game_config_t* config) {
+	return (*config)->create_state();
+}
+
+static inline void
+monte_user_copy_state(monte_state_t* dst, const monte_state_t* src) {
+	*dst = *src;
+}
+
+static inline void
+monte_user_apply_move(monte_state_t* state, const monte_move_t* move) {
+	Game::apply(*state, *move);
+}
+
+static inline void
+monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info) {
+	info->current_player = (monte_player_id_t)Game::inspect(*state, info->scores);
+}
+
+static inline void
+monte_user_iterate_moves(const monte_state_t* state, monte_iterator_t* iterator) {
+	Game::moves(*state, [iterator](const monte_move_t& move) {
+		monte_submit_move(iterator, &move);
+	});
+}
+
+static inline bool
+monte_user_moves_equal(const monte_move_t* lhs, const monte_move_t* rhs) {
+	return *lhs == *rhs;
+}
+
+static inline void
+monte_user_evaluate_state(const monte_state_t* state, float* values) {
+	detail::evaluate<Game, Policy>(*state, values);
+}
+
+}
+
+template <>
+struct Instance<MONTE_HPP_GAME, MONTE_HPP_POLICY> {
+	using Arena = MONTE_HPP_INSTANCE::Arena;
+	using monte_t = MONTE_HPP_INSTANCE::monte_t;
+	using monte_config_t = MONTE_HPP_INSTANCE::monte_config_t;
+	using monte_player_id_t = MONTE_HPP_INSTANCE::monte_player_id_t;
+};
+
+}
+}
+
+#undef MONTE_HPP_GAME
+#undef MONTE_HPP_POLICY
+#undef MONTE_HPP_INSTANCE
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef MONTE_ARENA_H
+#define MONTE_ARENA_H
+
+// Reference allocator for monte_user_alloc.
+//
+// Memory is carved out of large mmap-ed regions which are aligned to and
+// advised for transparent huge pages, and optionally bound to the NUMA node of
+// the thread which calls monte_arena_bind. Individual allocations are never
+// freed, monte recycles its own nodes. Everything is released at once with
+// monte_arena_destroy.
+//
+// The implementation needs POSIX and, for huge pages and NUMA binding, Linux.
+// Define _GNU_SOURCE (or _DEFAULT_SOURCE) before including any header in the
+// translation unit which defines MONTE_ARENA_IMPLEMENTATION.
+
+#include <stddef.h>
+
+#ifndef MONTE_ARENA_API
+#	define MONTE_ARENA_API
+#endif
+
+typedef struct monte_arena_s monte_arena_t;
+
+// region_size of 0 picks a default of 64 MiB
+MONTE_ARENA_API monte_arena_t*
+monte_arena_create(size_t region_size);
+
+MONTE_ARENA_API void
+monte_arena_destroy(monte_arena_t* arena);
+
+MONTE_ARENA_API void*
+monte_arena_alloc(monte_arena_t* arena, size_t size, size_t alignment);
+
+// Bind the rest of the arena to the NUMA node of the calling thread
+MONTE_ARENA_API void
+monte_arena_bind(monte_arena_t* arena);
+
+// Total size of the regions mapped so far
+MONTE_ARENA_API size_t
+monte_arena_size(const monte_arena_t* arena);
+
+#endif
+
+#ifdef MONTE_ARENA_IMPLEMENTATION
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#	include <unistd.h>
+#	include <sys/syscall.h>
+#endif
+
+#define MONTE_ARENA_DEFAULT_REGION_SIZE ((size_t)64 << 20)
+#define MONTE_ARENA_HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define MONTE_ARENA_NO_NODE -1
+
+// From linux/mempolicy.h
+#define MONTE_ARENA_MPOL_PREFERRED 1
+
+typedef struct monte_arena_region_s monte_arena_region_t;
+
+struct monte_arena_region_s {
+	monte_arena_region_t* next;
+	size_t size;
+};
+
+struct monte_arena_s {
+	size_t region_size;
+	size_t total_size;
+	int node;
+
+	monte_arena_region_t* regions;
+	uintptr_t head;
+	uintptr_t end;
+};
+
+static inline uintptr_t
+monte_arena_align(uintptr_t value, size_t alignment) {
+	return (value + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+}
+
+static void
+monte_arena_bind_range(monte_arena_t* arena, uintptr_t begin, uintptr_t end) {
+#ifdef __linux__
+	if (arena->node == MONTE_ARENA_NO_NODE) { return; }
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	begin = monte_arena_align(begin, (size_t)page_size);
+	if (begin >= end) { return; }
+
+	unsigned long node_mask = 1UL << arena->node;
+	// Best effort, the arena still works without the policy
+	syscall(
+		SYS_mbind,
+		(void*)begin, (unsigned long)(end - begin),
+		MONTE_ARENA_MPOL_PREFERRED,
+		&node_mask, (unsigned long)(sizeof(node_mask) * 8),
+		0
+	);
+#else
+	(void)arena;
+	(void)begin;
+	(void)end;
+#endif
+}
+
+static bool
+monte_arena_grow(monte_arena_t* arena, size_t min_size) {
+	size_t size = arena->region_size;
+	if (size < min_size + sizeof(monte_arena_region_t)) {
+		size = monte_arena_align(min_size + sizeof(monte_arena_region_t), MONTE_ARENA_HUGE_PAGE_SIZE);
+	}
+
+	// Over-reserve so the region can start on a huge page boundary
+	size_t reserved_size = size + MONTE_ARENA_HUGE_PAGE_SIZE;
+	void* reserved = mmap(
+		NULL, reserved_size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0
+	);
+	if (reserved == MAP_FAILED) { return false; }
+
+	uintptr_t reserved_begin = (uintptr_t)reserved;
+	uintptr_t begin = monte_arena_align(reserved_begin, MONTE_ARENA_HUGE_PAGE_SIZE);
+	uintptr_t end = begin + size;
+	if (begin > reserved_begin) {
+		munmap(reserved, begin - reserved_begin);
+	}
+	if (reserved_begin + reserved_size > end) {
+		munmap((void*)end, reserved_begin + reserved_size - end);
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise((void*)begin, size, MADV_HUGEPAGE);
+#endif
+	monte_arena_bind_range(arena, begin, end);
+
+	monte_arena_region_t* region = (monte_arena_region_t*)begin;
+	region->next = arena->regions;
+	region->size = size;
+	arena->regions = region;
+	arena->total_size += size;
+	arena->head = begin + sizeof(monte_arena_region_t);
+	arena->end = end;
+	return true;
+}
+
+monte_arena_t*
+monte_arena_create(size_t region_size) {
+	monte_arena_t* arena = malloc(sizeof(monte_arena_t));
+	if (arena == NULL) { return NULL; }
+
+	if (region_size == 0) { region_size = MONTE_ARENA_DEFAULT_REGION_SIZE; }
+	*arena = (monte_arena_t){
+		.region_size = monte_arena_align(region_size, MONTE_ARENA_HUGE_PAGE_SIZE),
+		.node = MONTE_ARENA_NO_NODE,
+	};
+	return arena;
+}
+
+void
+monte_arena_destroy(monte_arena_t* arena) {
+	for (
+		monte_arena_region_t* itr = arena->regions;
+		itr != NULL;
+	) {
+		monte_arena_region_t* next = itr->next;
+		munmap(itr, itr->size);
+		itr = next;
+	}
+
+	free(arena);
+}
+
+void*
+monte_arena_alloc(monte_arena_t* arena, size_t size, size_t alignment) {
+	uintptr_t ptr = monte_arena_align(arena->head, alignment);
+	if (arena->regions == NULL || ptr + size > arena->end) {
+		if (!monte_arena_grow(arena, size + alignment)) { return NULL; }
+		ptr = monte_arena_align(arena->head, alignment);
+	}
+
+	arena->head = ptr + size;
+	return (void*)ptr;
+}
+
+void
+monte_arena_bind(monte_arena_t* arena) {
+#ifdef __linux__
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) { return; }
+	if ((int)node == arena->node || node >= sizeof(unsigned long) * 8) { return; }
+
+	arena->node = (int)node;
+	if (arena->regions != NULL) {
+		monte_arena_bind_range(arena, arena->head, arena->end);
+	}
+#else
+	(void)arena;
+#endif
+}
+
+size_t
+monte_arena_size(const monte_arena_t* arena) {
+	return arena->total_size;
+}
+
+#endif
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Rebuilds search trees from a trace recorded with monte_trace (e.g. with
+// mnk_ai_config_t.trace_path) and times it. Only the tree side of the search
+// runs: selection, expansion and backpropagation, without any game code.
+// This isolates changes to node layout, allocation and UCT from the cost of
+// the game.
+
+#define MONTE_ARENA_IMPLEMENTATION
+#include "monte_arena.h"
+
+// Moves are never looked at, but keep them the size of mnk moves so that
+// nodes have the same layout as in the recorded search
+#define MONTE_MOVE_TYPE struct { int8_t x; int8_t y; }
+#define MONTE_ALLOCATOR_CTX_TYPE monte_arena_t
+#define MONTE_ENABLE_REPLAY
+#define MONTE_IMPLEMENTATION
+#include "monte.h"
+
+#define REPLAY_ARENA_REGION_SIZE ((size_t)64 << 20)
+// Offset of the number of players in the trace
+#define REPLAY_NUM_PLAYERS_OFFSET 5
+
+// The game is never consulted, except for the player at the root, which
+// monte_replay overwrites
+
+void*
+monte_user_alloc(size_t size, size_t alignment, monte_allocator_ctx_t* ctx) {
+	return monte_arena_alloc(ctx, size, alignment);
+}
+
+float
+monte_user_rng_next(monte_rng_state_t* rng_state) {
+	(void)rng_state;
+	return 0.f;
+}
+
+monte_state_t*
+monte_user_create_state(const monte_game_config_t* config) {
+	(void)config;
+	static monte_state_t state;
+	return &state;
+}
+
+void
+monte_user_copy_state(monte_state_t* dst, const monte_state_t* src) {
+	(void)dst;
+	(void)src;
+}
+
+void
+monte_user_apply_move(monte_state_t* state, const monte_move_t* move) {
+	(void)state;
+	(void)move;
+}
+
+void
+monte_user_inspect_state(const monte_state_t* state, monte_state_info_t* info) {
+	(void)state;
+	info->current_player = 0;
+}
+
+void
+monte_user_iterate_moves(const monte_state_t* state, monte_iterator_t* iterator) {
+	(void)state;
+	(void)iterator;
+}
+
+bool
+monte_user_moves_equal(const monte_move_t* lhs, const monte_move_t* rhs) {
+	return lhs->x == rhs->x && lhs->y == rhs->y;
+}
+
+static uint8_t*
+read_file(const char* path, size_t* size) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) { return NULL; }
+
+	size_t capacity = 1 << 20;
+	uint8_t* data = malloc(capacity);
+	*size = 0;
+	size_t num_read;
+	while ((num_read = fread(data + *size, 1, capacity - *size, file)) > 0) {
+		*size += num_read;
+		if (*size == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+	}
+
+	fclose(file);
+	return data;
+}
+
+static double
+seconds_since(const struct timespec* start) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <trace> [num_runs]\n", argv[0]);
+		return 1;
+	}
+
+	size_t size;
+	uint8_t* trace = read_file(argv[1], &size);
+	if (trace == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	if (size <= REPLAY_NUM_PLAYERS_OFFSET) {
+		fprintf(stderr, "%s: not a trace\n", argv[1]);
+		free(trace);
+		return 1;
+	}
+
+	int num_runs = argc > 2 ? atoi(argv[2]) : 5;
+	double best_time = 0.0;
+	for (int run = 0; run < num_runs; ++run) {
+		monte_arena_t* arena = monte_arena_create(REPLAY_ARENA_REGION_SIZE);
+		monte_state_t initial_state = { 0 };
+		monte_t* monte = monte_create(&initial_state, (monte_config_t){
+			.num_players = trace[REPLAY_NUM_PLAYERS_OFFSET],
+			.allocator_ctx = arena,
+		});
+
+		struct timespec start;
+		timespec_get(&start, TIME_UTC);
+		monte_index_t num_divergences;
+		monte_index_t num_iterations = monte_replay(monte, trace, size, &num_divergences);
+		double elapsed = seconds_since(&start);
+		size_t memory_usage = monte_arena_size(arena);
+		monte_arena_destroy(arena);
+
+		if (num_iterations < 0) {
+			fprintf(stderr, "%s: malformed trace\n", argv[1]);
+			free(trace);
+			return 1;
+		}
+
+		if (run == 0 || elapsed < best_time) { best_time = elapsed; }
+		printf(
+			"%d iterations, %d divergences in %.3fs (%.0f ns/iteration), %zuMB\n",
+			num_iterations,
+			num_divergences,
+			elapsed,
+			elapsed * 1e9 / (double)(num_iterations > 0 ? num_iterations : 1),
+			memory_usage >> 20
+		);
+	}
+
+	printf("best: %.3fs\n", best_time);
+	free(trace);
+	return 0;
+}
@@ -0,0 +1,240 @@
+#include "mnk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include <time.h>
+#include "rnd.h"
+
+// Plays many games against itself in parallel on a shared scheduler and
+// streams them to a binary file:
+//
+//   header:   "MNKS" u8 version, u8 width, u8 height, u8 stride
+//   game:     i8 winner, u16 num_plies, then num_plies times:
+//   ply:      u8 x, u8 y, u16 num_moves, then num_moves times:
+//   move:     u8 x, u8 y, u16 share of root visits, out of 65535
+//
+// Positions are not stored, they are replayed from the moves. Integers are
+// little-endian.
+
+#define SELFPLAY_VERSION 1
+// Moves in the opening are sampled by visit count instead of taking the
+// most visited one, so that games differ from each other
+#define SELFPLAY_NUM_SAMPLED_PLIES 6
+// Whole games are handed to stdio, which writes them out in large blocks
+#define SELFPLAY_FILE_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+} byte_buffer_t;
+
+typedef struct {
+	mnk_config_t game_config;
+	mnk_scheduler_t* scheduler;
+	int num_games;
+	int num_iterations;
+
+	atomic_int next_game;
+	atomic_int num_plies;
+
+	mtx_t file_mutex;
+	FILE* file;
+} selfplay_t;
+
+static void
+put_bytes(byte_buffer_t* buffer, const void* bytes, size_t size) {
+	if (buffer->size + size > buffer->capacity) {
+		buffer->capacity = (buffer->size + size) * 2;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+
+	memcpy(buffer->data + buffer->size, bytes, size);
+	buffer->size += size;
+}
+
+static void
+put_u8(byte_buffer_t* buffer, uint8_t value) {
+	put_bytes(buffer, &value, 1);
+}
+
+static void
+put_u16(byte_buffer_t* buffer, uint16_t value) {
+	uint8_t bytes[2] = { value & 0xff, value >> 8 };
+	put_bytes(buffer, bytes, 2);
+}
+
+static void
+patch_u16(byte_buffer_t* buffer, size_t offset, uint16_t value) {
+	buffer->data[offset] = value & 0xff;
+	buffer->data[offset + 1] = value >> 8;
+}
+
+static mnk_move_t
+sample_move(const mnk_ai_snapshot_t* snapshot, rnd_pcg_t* rng) {
+	int target = rnd_pcg_range(rng, 0, snapshot->num_visits - 1);
+	for (int i = 0; i < snapshot->num_moves; ++i) {
+		target -= snapshot->moves[i].num_visits;
+		if (target < 0) { return snapshot->moves[i].move; }
+	}
+
+	return snapshot->moves[snapshot->num_moves - 1].move;
+}
+
+static void
+play_game(selfplay_t* selfplay, int game_index, byte_buffer_t* record) {
+	const mnk_config_t* config = &selfplay->game_config;
+	int area = config->width * config->height;
+
+	mnk_state_t* state = mnk_state_create(config);
+	mnk_ai_t* ai = mnk_ai_create(&(mnk_ai_config_t){
+		.game_config = *config,
+		.initial_state = state,
+		.num_threads = 1,
+		.num_iterations = selfplay->num_iterations,
+		.scheduler = selfplay->scheduler,
+	});
+	mnk_ai_move_stats_t* moves = malloc(sizeof(mnk_ai_move_stats_t) * area);
+	rnd_pcg_t rng;
+	rnd_pcg_seed(&rng, game_index);
+
+	record->size = 0;
+	put_u8(record, 0);
+	put_u16(record, 0);
+
+	int num_plies = 0;
+	while (state->player != -1) {
+		mnk_move_t move = mnk_ai_pick_move(ai);
+
+		// The search is done, the snapshot is its final result
+		mnk_ai_snapshot_t snapshot = {
+			.moves = moves,
+			.max_moves = area,
+		};
+		mnk_ai_snapshot(ai, &snapshot);
+		if (num_plies < SELFPLAY_NUM_SAMPLED_PLIES && snapshot.num_moves > 0) {
+			move = sample_move(&snapshot, &rng);
+		}
+
+		int total_visits = 0;
+		for (int i = 0; i < snapshot.num_moves; ++i) {
+			total_visits += moves[i].num_visits;
+		}
+
+		put_u8(record, move.x);
+		put_u8(record, move.y);
+		put_u16(record, snapshot.num_moves);
+		for (int i = 0; i < snapshot.num_moves; ++i) {
+			put_u8(record, moves[i].move.x);
+			put_u8(record, moves[i].move.y);
+			put_u16(record, (uint16_t)((int64_t)moves[i].num_visits * 65535 / total_visits));
+		}
+
+		mnk_state_apply(state, move);
+		// Keeps the subtree of the move played
+		mnk_ai_apply(ai, move);
+		++num_plies;
+	}
+
+	record->data[0] = (uint8_t)state->winner;
+	patch_u16(record, 1, num_plies);
+	atomic_fetch_add_explicit(&selfplay->num_plies, num_plies, memory_order_relaxed);
+
+	free(moves);
+	mnk_ai_destroy(ai);
+	mnk_state_destroy(state);
+}
+
+static int
+selfplay_worker_main(void* userdata) {
+	selfplay_t* selfplay = userdata;
+	byte_buffer_t record = { 0 };
+
+	for (;;) {
+		int game_index = atomic_fetch_add_explicit(&selfplay->next_game, 1, memory_order_relaxed);
+		if (game_index >= selfplay->num_games) { break; }
+
+		play_game(selfplay, game_index, &record);
+
+		mtx_lock(&selfplay->file_mutex);
+		fwrite(record.data, record.size, 1, selfplay->file);
+		mtx_unlock(&selfplay->file_mutex);
+	}
+
+	free(record.data);
+	return 0;
+}
+
+static double
+seconds_since(const struct timespec* start) {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <output> [num_games] [num_parallel_games] [num_iterations]\n", argv[0]);
+		return 1;
+	}
+
+	int num_parallel_games = argc > 3 ? atoi(argv[3]) : 64;
+	selfplay_t selfplay = {
+		.game_config = {
+			.width = 9,
+			.height = 9,
+			.stride = 5,
+			.candidate_distance = 2,
+		},
+		.num_games = argc > 2 ? atoi(argv[2]) : 256,
+		.num_iterations = argc > 4 ? atoi(argv[4]) : 20000,
+		// One worker per CPU, games waiting on a search do not hold any
+		.scheduler = mnk_scheduler_create(0),
+	};
+
+	selfplay.file = fopen(argv[1], "wb");
+	if (selfplay.file == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	setvbuf(selfplay.file, NULL, _IOFBF, SELFPLAY_FILE_BUFFER_SIZE);
+	mtx_init(&selfplay.file_mutex, mtx_plain);
+
+	const uint8_t header[] = {
+		'M', 'N', 'K', 'S',
+		SELFPLAY_VERSION,
+		selfplay.game_config.width,
+		selfplay.game_config.height,
+		selfplay.game_config.stride,
+	};
+	fwrite(header, sizeof(header), 1, selfplay.file);
+
+	struct timespec start;
+	timespec_get(&start, TIME_UTC);
+
+	thrd_t* threads = malloc(sizeof(thrd_t) * num_parallel_games);
+	for (int i = 0; i < num_parallel_games; ++i) {
+		thrd_create(&threads[i], selfplay_worker_main, &selfplay);
+	}
+	for (int i = 0; i < num_parallel_games; ++i) {
+		thrd_join(threads[i], NULL);
+	}
+
+	double elapsed = seconds_since(&start);
+	printf(
+		"%d games, %d plies in %.1fs (%.0f games/hour)\n",
+		selfplay.num_games,
+		atomic_load(&selfplay.num_plies),
+		elapsed,
+		(double)selfplay.num_games * 3600.0 / elapsed
+	);
+
+	fclose(selfplay.file);
+	mtx_destroy(&selfplay.file_mutex);
+	mnk_scheduler_destroy(selfplay.scheduler);
+	free(threads);
+
+	return 0;
+}